@@ -1,14 +1,292 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include <pthread.h>
 
 #define MAX_ITER (10)
+// number of items pushed through the lock-free buffer in the throughput run
+#define SPSC_ITEMS (10000000)
+// number of items pushed through the MPMC buffer per stress run
+#define MPMC_ITEMS (2000000)
+// largest thread count of the MPMC stress run
+#define MPMC_MAX_THREADS (32)
+// number of records pushed through a buffer in the bulk run
+#define BULK_RECORDS (200000)
+// length of one record in the bulk run
+#define BULK_RECORD_LEN (64)
+// number of records pushed through a buffer with reserve/commit
+#define RECORD_ITEMS (1000000)
+// largest number of producer (and of consumer) threads in the benchmark
+#define BENCH_MAX_THREADS (64)
+// number of latency histogram buckets: 16 linear sub-buckets per power of two
+#define BENCH_BUCKETS (1024)
+// size of a cache line, used to keep producer and consumer state apart
+#define CACHE_LINE (64)
+// number of busy polls before a waiting thread yields its core or parks
+#define SPIN_LIMIT (64)
+
+// ######################################################
+// Start wait strategy section
+
+/*
+How a thread waits for a full buffer to get space or an empty buffer to get items.
+Selected per buffer at init time.
+*/
+enum WaitStrategy {
+  // poll without ever giving the core away: lowest latency, burns one core per waiter
+  WAIT_SPIN,
+  // poll SPIN_LIMIT times, then sched_yield between polls
+  WAIT_YIELD,
+  // poll SPIN_LIMIT times, then sleep in the kernel until the other side wakes us
+  WAIT_PARK
+};
+
+/*
+Event count the WAIT_PARK strategy sleeps on.
+A waiter registers in waiters, reads seq and checks its condition once more before it
+sleeps on seq (futex); a waker bumps seq before waking. Since the waker only issues the
+wake syscall when waiters > 0, the common case without sleepers costs no syscall.
+*/
+struct WaitQueue {
+  atomic_uint seq;
+  atomic_int waiters;
+};
+
+// hint the cpu that we are inside a spin loop
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// sleep as long as *addr still holds val
+static inline void futexWait(atomic_uint *addr, unsigned val) {
+#ifdef __linux__
+  syscall(SYS_futex, (unsigned*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  // no futex available: the caller re-checks its condition after a yield
+  (void)addr; (void)val;
+  sched_yield();
+#endif
+}
+
+// wake all threads sleeping on addr
+static inline void futexWake(atomic_uint *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, (unsigned*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  (void)addr;
+#endif
+}
+
+void initWaitQueue(struct WaitQueue *q) {
+  atomic_init(&q->seq, 0);
+  atomic_init(&q->waiters, 0);
+}
+
+/*
+One waiting step in user space. Returns 0 once a WAIT_PARK thread has spun long enough
+and should park, 1 otherwise.
+*/
+static inline int waitSpin(enum WaitStrategy strategy, int *spins) {
+  if (strategy == WAIT_SPIN) {
+    cpuRelax();
+    return 1;
+  }
+  if (*spins < SPIN_LIMIT) {
+    ++(*spins);
+    cpuRelax();
+    return 1;
+  }
+  if (strategy == WAIT_YIELD) {
+    sched_yield();
+    return 1;
+  }
+  return 0;
+}
+
+// register as sleeper and return the event count to sleep on
+static inline unsigned prepareWait(struct WaitQueue *q) {
+  atomic_fetch_add_explicit(&q->waiters, 1, memory_order_relaxed);
+  // pairs with the fence in wakeWaiters: either we see the new state or the waker sees us
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&q->seq, memory_order_relaxed);
+}
+
+static inline void finishWait(struct WaitQueue *q) {
+  atomic_fetch_sub_explicit(&q->waiters, 1, memory_order_relaxed);
+}
+
+// wait according to strategy as long as cond holds; cond is evaluated again before sleeping
+#define WAIT_WHILE(q, strategy, cond) \
+  do { \
+    int spins_ = 0; \
+    while (cond) { \
+      if (waitSpin((strategy), &spins_)) \
+        continue; \
+      unsigned key_ = prepareWait(q); \
+      if (cond) \
+        futexWait(&(q)->seq, key_); \
+      finishWait(q); \
+    } \
+  } while (0)
+
+// call after publishing progress: wakes sleepers, but only issues a syscall if there are any
+static inline void wakeWaiters(struct WaitQueue *q, enum WaitStrategy strategy) {
+  // nobody ever sleeps with the spinning strategies
+  if (strategy != WAIT_PARK)
+    return;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->waiters, memory_order_relaxed) > 0) {
+    atomic_fetch_add_explicit(&q->seq, 1, memory_order_relaxed);
+    futexWake(&q->seq);
+  }
+}
+
+// parse "spin", "yield" or "park" (default)
+enum WaitStrategy parseWaitStrategy(const char *name) {
+  if (name != NULL && strcmp(name, "spin") == 0)
+    return WAIT_SPIN;
+  if (name != NULL && strcmp(name, "yield") == 0)
+    return WAIT_YIELD;
+  return WAIT_PARK;
+}
+
+// end wait strategy section
+// ######################################################
+
+// ######################################################
+// Start tracing section
+
+// monotonic time in nanoseconds, used to timestamp items and trace events
+static inline uint64_t nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+Event tracing of the buffer operations (formerly printf("put")/printf("get") in the hot path).
+Compile with -DBUFFER_TRACE and run with BBUFFER_TRACE=1 in the environment to record events.
+Every thread records into a ring of its own, so recording takes no lock and touches no shared
+cache line; old events are overwritten. The rings of all threads are dumped to stderr at exit.
+Without -DBUFFER_TRACE the TRACE macro compiles to nothing.
+*/
+enum TraceEvent { TRACE_PUT, TRACE_GET };
+
+#ifdef BUFFER_TRACE
+
+// events kept per thread, must be a power of two
+#define TRACE_RING_SIZE (4096)
+
+struct TraceRecord {
+  uint64_t ns;
+  const void *buffer;
+  int event;
+  // number of items moved by the operation
+  int count;
+};
+
+struct TraceRing {
+  struct TraceRecord records[TRACE_RING_SIZE];
+  // total number of events recorded by the owning thread
+  uint64_t next;
+  int thread;
+  struct TraceRing *link;
+};
+
+static atomic_int traceEnabled;
+// the list of rings is only locked when a thread records its first event and at exit
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing *traceRings;
+static int traceThreads;
+static _Thread_local struct TraceRing *traceRing;
+
+// print the events of every thread, oldest first, and free the rings
+static void traceDump(void) {
+  static const char *names[] = { "put", "get" };
+  pthread_mutex_lock(&traceLock);
+  while (traceRings != NULL) {
+    struct TraceRing *r = traceRings;
+    uint64_t i = (r->next > TRACE_RING_SIZE) ? r->next - TRACE_RING_SIZE : 0;
+    for (; i < r->next; ++i) {
+      struct TraceRecord *rec = &r->records[i & (TRACE_RING_SIZE - 1)];
+      fprintf(stderr, "thread %d %llu ns %s %p x%d\n", r->thread, (unsigned long long)rec->ns,
+              names[rec->event], rec->buffer, rec->count);
+    }
+    traceRings = r->link;
+    free(r);
+  }
+  pthread_mutex_unlock(&traceLock);
+}
+
+static struct TraceRing *traceRegister(void) {
+  struct TraceRing *r = (struct TraceRing*)calloc(1, sizeof(struct TraceRing));
+  if (r == NULL)
+    exit(-1);
+  pthread_mutex_lock(&traceLock);
+  r->thread = traceThreads++;
+  r->link = traceRings;
+  traceRings = r;
+  pthread_mutex_unlock(&traceLock);
+  return r;
+}
+
+static inline void traceRecord(const void *buffer, int event, int count) {
+  if (!atomic_load_explicit(&traceEnabled, memory_order_relaxed))
+    return;
+  struct TraceRing *r = traceRing;
+  if (r == NULL)
+    r = traceRing = traceRegister();
+  struct TraceRecord *rec = &r->records[r->next & (TRACE_RING_SIZE - 1)];
+  rec->ns = nowNs();
+  rec->buffer = buffer;
+  rec->event = event;
+  rec->count = count;
+  ++r->next;
+}
+
+// enable tracing if BBUFFER_TRACE is set, the events are dumped at exit
+void initTrace(void) {
+  if (getenv("BBUFFER_TRACE") != NULL) {
+    atomic_store(&traceEnabled, 1);
+    atexit(traceDump);
+  }
+}
+
+#define TRACE(buffer, event, count) traceRecord((buffer), (event), (count))
+
+#else
+
+static inline void initTrace(void) {}
+
+#define TRACE(buffer, event, count) do { (void)(buffer); (void)(count); } while (0)
+
+#endif
+
+// end tracing section
+// ######################################################
 
 struct Buffer {
+  // storage for size items of elemSize bytes each
   char *buf;
+  int elemSize;
   int in;
   int out;
   int count;
@@ -18,81 +296,213 @@ struct Buffer {
   // add condition to buffer struct
   pthread_cond_t not_full;
   pthread_cond_t not_empty;
+  // how put/get wait, and how many threads currently sleep on not_full/not_empty
+  enum WaitStrategy strategy;
+  int waiting_put;
+  int waiting_get;
 };
 
-void put(struct Buffer *b, char c) {
+/*
+One waiting step on cond while holding the mutex; *spins counts the steps of this wait and
+starts at 0. Like waitSpin, the first SPIN_LIMIT steps release the mutex for a moment and
+poll again, so that the other side can make progress. After that WAIT_YIELD yields between
+polls, and WAIT_PARK sleeps on cond and is counted in *waiting, so the other side only
+signals if a thread actually sleeps. WAIT_SPIN never sleeps.
+*/
+static void bufferWait(struct Buffer *b, pthread_cond_t *cond, int *waiting, int *spins) {
+  if (b->strategy == WAIT_PARK && *spins >= SPIN_LIMIT) {
+    ++(*waiting);
+    /*
+    The following line
+    1. frees the mutex (i.e., enables the other side to change the buffer)
+    2. waits until the condition gets signaled, then locks the mutex and proceeds with subsequent LOC
+    */
+    pthread_cond_wait(cond, &(b->mutex));
+    --(*waiting);
+  } else {
+    pthread_mutex_unlock(&(b->mutex));
+    waitSpin(b->strategy, spins);
+    pthread_mutex_lock(&(b->mutex));
+  }
+}
+
+/*
+Signal cond after items items (or slots) became available, but skip the wake up (and its
+syscall) if no thread sleeps on it. One item can only let one waiter proceed, so a single
+signal is enough; the bulk calls may make room for several waiters and wake all of them.
+*/
+static inline void bufferSignal(pthread_cond_t *cond, int waiting, int items) {
+  if (waiting == 0)
+    return;
+  if (items > 1)
+    pthread_cond_broadcast(cond);
+  else
+    pthread_cond_signal(cond);
+}
+
+void put(struct Buffer *b, const void *item) {
   /*
   Uses conditional sychronization with signal mechanism!
   */
 
-  printf("put\n");
   // lock mutex, this thread waits until it obtains the mutex
   pthread_mutex_lock(&b->mutex);
+  int spins = 0;
   // while buffer is full, this thread should not proceed!
   while (b->count == b->size)
-  {
-    /*
-    The following line
-    1. frees the mutex (i.e., enables other get thread to release an item as we need space in buffer to put another item)
-    2. waits until the condition gets true, then locks the mutex and proceeds with subsequent LOC
-    */
-    pthread_cond_wait(&(b->not_full), &(b->mutex));
-  }
+    // a get thread has to release an item as we need space in buffer to put another item
+    bufferWait(b, &(b->not_full), &(b->waiting_put), &spins);
   // put item in buffer, increment counter
-  b->buf[b->in] = c;
+  memcpy(b->buf + b->in * b->elemSize, item, b->elemSize);
   b->in = ((b->in)+1)%(b->size);
     ++(b->count);
   // unblocks at least one of the threads that are blocked on the specified condition variable cond
   // (if any threads are blocked on cond).
-  pthread_cond_signal(&(b->not_empty));
+  bufferSignal(&(b->not_empty), b->waiting_get, 1);
   /*
-  NOTE: The function pthread_cond_signal is only correct if exactly one producer and consumer thread exist.
-  Otherwise a deadlock can be generated (pthread_cond_broadcast instead).
+  NOTE: signalling a single thread is also correct with several producers and consumers: puts and
+  gets wait on separate conditions, one item lets exactly one waiting get proceed, and every
+  woken thread checks the count again in its while loop.
   */
   // unlock mutex  
   pthread_mutex_unlock(&(b->mutex));
+  // record the event outside of the critical section
+  TRACE(b, TRACE_PUT, 1);
 }
 
-char get(struct Buffer *b) {
+void get(struct Buffer *b, void *item) {
   /*
   Uses conditional sychronization with signal mechanism!
   */
 
   // lock mutex
   pthread_mutex_lock(&(b->mutex));
+  int spins = 0;
   // while buffer is empty, wait as we have no items left to get from the buffer
   while (b->count == 0)
-  {
-    /*
-    The following line
-    1. frees the mutex (i.e., enables other get thread to release an item as we need space in buffer to put another item)
-    2. waits until the condition gets true, then locks the mutex and proceeds with subsequent LOC
-    */
-    pthread_cond_wait(&(b->not_empty), &(b->mutex));
-  }
-  printf("get\n");
+    // a put thread has to add an item first
+    bufferWait(b, &(b->not_empty), &(b->waiting_get), &spins);
   // get top item from buffer
-  char c = b->buf[b->out];
-  b->buf[b->out] = '\0';
+  memcpy(item, b->buf + b->out * b->elemSize, b->elemSize);
   b->out = ((b->out)+1)%(b->size);
   --(b->count);
   // unblocks at least one of the threads that are blocked on the specified condition variable cond
   // (if any threads are blocked on cond).
-  pthread_cond_signal(&(b->not_full));
+  bufferSignal(&(b->not_full), b->waiting_put, 1);
   /*
-  NOTE: The function pthread_cond_signal is only correct if exactly one producer and consumer thread exist.
-  Otherwise a deadlock can be generated (pthread_cond_broadcast instead).
+  NOTE: signalling a single thread is also correct with several producers and consumers: puts and
+  gets wait on separate conditions, one free slot lets exactly one waiting put proceed, and every
+  woken thread checks the count again in its while loop.
   */
   // unlock mutex
   pthread_mutex_unlock(&(b->mutex));
-  return c;
+  TRACE(b, TRACE_GET, 1);
+}
+
+void putN(struct Buffer *b, const void *items, int n) {
+  /*
+  Bulk version of put: copies all n items into the buffer.
+  Instead of one lock and one signal per item, a whole run of items is moved per lock
+  acquisition with at most two memcpys (before and after the wrap around of the ring).
+  Waits as often as needed if the buffer does not have room for all n items at once.
+  */
+  const char *src = (const char*)items;
+  int total = n;
+  pthread_mutex_lock(&(b->mutex));
+  while (n > 0) {
+    int spins = 0;
+    while (b->count == b->size)
+      bufferWait(b, &(b->not_full), &(b->waiting_put), &spins);
+    // as many items as fit into the free part of the buffer
+    int k = b->size - b->count;
+    if (k > n)
+      k = n;
+    // first part up to the end of the ring, second part from its start
+    int first = b->size - b->in;
+    if (first > k)
+      first = k;
+    memcpy(b->buf + b->in * b->elemSize, src, first * b->elemSize);
+    memcpy(b->buf, src + first * b->elemSize, (k - first) * b->elemSize);
+    b->in = (b->in + k) % b->size;
+    b->count += k;
+    src += k * b->elemSize;
+    n -= k;
+    bufferSignal(&(b->not_empty), b->waiting_get, k);
+  }
+  pthread_mutex_unlock(&(b->mutex));
+  TRACE(b, TRACE_PUT, total);
 }
 
-void initBuffer(struct Buffer *b, int size) {
+int getN(struct Buffer *b, void *items, int max) {
+  /*
+  Bulk version of get: waits until at least one item is available and then copies
+  up to max items in one go. Returns the number of items copied to items.
+  */
+  char *dst = (char*)items;
+  pthread_mutex_lock(&(b->mutex));
+  int spins = 0;
+  while (b->count == 0)
+    bufferWait(b, &(b->not_empty), &(b->waiting_get), &spins);
+  int k = (b->count < max) ? b->count : max;
+  int first = b->size - b->out;
+  if (first > k)
+    first = k;
+  memcpy(dst, b->buf + b->out * b->elemSize, first * b->elemSize);
+  memcpy(dst + first * b->elemSize, b->buf, (k - first) * b->elemSize);
+  b->out = (b->out + k) % b->size;
+  b->count -= k;
+  bufferSignal(&(b->not_full), b->waiting_put, k);
+  pthread_mutex_unlock(&(b->mutex));
+  TRACE(b, TRACE_GET, k);
+  return k;
+}
+
+/*
+Zero-copy access: putReserve returns the free slot the next item goes to, the producer
+writes its item directly into the slot and then calls putCommit to publish it.
+getReserve/getCommit do the same for reading the oldest item in place.
+The mutex is held from reserve to commit, so keep the work in between short.
+*/
+void *putReserve(struct Buffer *b) {
+  pthread_mutex_lock(&(b->mutex));
+  int spins = 0;
+  while (b->count == b->size)
+    bufferWait(b, &(b->not_full), &(b->waiting_put), &spins);
+  return b->buf + b->in * b->elemSize;
+}
+
+void putCommit(struct Buffer *b) {
+  b->in = ((b->in)+1)%(b->size);
+  ++(b->count);
+  bufferSignal(&(b->not_empty), b->waiting_get, 1);
+  pthread_mutex_unlock(&(b->mutex));
+  TRACE(b, TRACE_PUT, 1);
+}
+
+const void *getReserve(struct Buffer *b) {
+  pthread_mutex_lock(&(b->mutex));
+  int spins = 0;
+  while (b->count == 0)
+    bufferWait(b, &(b->not_empty), &(b->waiting_get), &spins);
+  return b->buf + b->out * b->elemSize;
+}
+
+void getCommit(struct Buffer *b) {
+  b->out = ((b->out)+1)%(b->size);
+  --(b->count);
+  bufferSignal(&(b->not_full), b->waiting_put, 1);
+  pthread_mutex_unlock(&(b->mutex));
+  TRACE(b, TRACE_GET, 1);
+}
+
+void initBuffer(struct Buffer *b, int size, int elemSize, enum WaitStrategy strategy) {
   b->in = 0; b->out = 0; b->count = 0;
+  b->strategy = strategy;
+  b->waiting_put = 0; b->waiting_get = 0;
   b->size = size;
-  // allocate memory of size times bytes
-  b->buf = (char*)malloc(sizeof(char) * size);
+  b->elemSize = elemSize;
+  // allocate memory of size times elemSize bytes
+  b->buf = (char*)malloc((size_t)elemSize * size);
   // if memory allocation failed
   if (b->buf == NULL)
     // exit program with -1
@@ -112,6 +522,935 @@ void destroyBuffer(struct Buffer* b) {
   pthread_cond_destroy(&(b->not_full));
 };
 
+// ######################################################
+// Start lock-free SPSC section
+
+/*
+Lock-free ring buffer for exactly one producer and one consumer thread.
+The producer only writes tail, the consumer only writes head, so no lock is needed:
+publishing an item is a single release store of tail, taking one a release store of head.
+Both indices count up forever and are mapped into the ring with a mask, therefore the
+capacity is always a power of two.
+*/
+struct SpscBuffer {
+  // consumer side: read index and the last tail value seen by the consumer
+  _Alignas(CACHE_LINE) atomic_size_t head;
+  size_t cachedTail;
+  // the consumer sleeps here while the buffer is empty
+  struct WaitQueue notEmpty;
+  // producer side: write index and the last head value seen by the producer
+  _Alignas(CACHE_LINE) atomic_size_t tail;
+  size_t cachedHead;
+  // the producer sleeps here while the buffer is full
+  struct WaitQueue notFull;
+  // shared read-only state
+  _Alignas(CACHE_LINE) char *buf;
+  enum WaitStrategy strategy;
+  size_t elemSize;
+  size_t size;
+  size_t mask;
+};
+
+void *spscPutReserve(struct SpscBuffer *b) {
+  // only this thread writes tail, so a relaxed load is enough
+  size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+  // only reload head (the consumer's cache line) if the cached value says the ring is full
+  if (tail - b->cachedHead == b->size)
+    WAIT_WHILE(&b->notFull, b->strategy,
+               tail - (b->cachedHead = atomic_load_explicit(&b->head, memory_order_acquire)) == b->size);
+  // the producer writes the item directly into the free slot
+  return b->buf + (tail & b->mask) * b->elemSize;
+}
+
+void spscPutCommit(struct SpscBuffer *b) {
+  size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+  // release: the item must be visible before the consumer sees the new tail
+  atomic_store_explicit(&b->tail, tail + 1, memory_order_release);
+  wakeWaiters(&b->notEmpty, b->strategy);
+  TRACE(b, TRACE_PUT, 1);
+}
+
+const void *spscGetReserve(struct SpscBuffer *b) {
+  // only this thread writes head, so a relaxed load is enough
+  size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+  // only reload tail (the producer's cache line) if the cached value says the ring is empty
+  if (head == b->cachedTail)
+    WAIT_WHILE(&b->notEmpty, b->strategy,
+               head == (b->cachedTail = atomic_load_explicit(&b->tail, memory_order_acquire)));
+  // the consumer reads the item in place
+  return b->buf + (head & b->mask) * b->elemSize;
+}
+
+void spscGetCommit(struct SpscBuffer *b) {
+  size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+  // release: the slot may only be reused after we have read it
+  atomic_store_explicit(&b->head, head + 1, memory_order_release);
+  wakeWaiters(&b->notFull, b->strategy);
+  TRACE(b, TRACE_GET, 1);
+}
+
+void spscPut(struct SpscBuffer *b, const void *item) {
+  memcpy(spscPutReserve(b), item, b->elemSize);
+  spscPutCommit(b);
+}
+
+void spscGet(struct SpscBuffer *b, void *item) {
+  memcpy(item, spscGetReserve(b), b->elemSize);
+  spscGetCommit(b);
+}
+
+void spscPutN(struct SpscBuffer *b, const void *items, int n) {
+  // bulk version of spscPut: one release store of tail publishes a whole run of items
+  const char *src = (const char*)items;
+  int total = n;
+  size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+  while (n > 0) {
+    if (tail - b->cachedHead == b->size)
+      WAIT_WHILE(&b->notFull, b->strategy,
+                 tail - (b->cachedHead = atomic_load_explicit(&b->head, memory_order_acquire)) == b->size);
+    size_t k = b->size - (tail - b->cachedHead);
+    if (k > (size_t)n)
+      k = n;
+    // copy around the wrap of the ring with at most two memcpys
+    size_t idx = tail & b->mask;
+    size_t first = b->size - idx;
+    if (first > k)
+      first = k;
+    memcpy(b->buf + idx * b->elemSize, src, first * b->elemSize);
+    memcpy(b->buf, src + first * b->elemSize, (k - first) * b->elemSize);
+    tail += k;
+    atomic_store_explicit(&b->tail, tail, memory_order_release);
+    wakeWaiters(&b->notEmpty, b->strategy);
+    src += k * b->elemSize;
+    n -= k;
+  }
+  TRACE(b, TRACE_PUT, total);
+}
+
+int spscGetN(struct SpscBuffer *b, void *items, int max) {
+  // bulk version of spscGet: takes up to max items, at least one
+  char *dst = (char*)items;
+  size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+  if (head == b->cachedTail)
+    WAIT_WHILE(&b->notEmpty, b->strategy,
+               head == (b->cachedTail = atomic_load_explicit(&b->tail, memory_order_acquire)));
+  size_t k = b->cachedTail - head;
+  if (k > (size_t)max)
+    k = max;
+  size_t idx = head & b->mask;
+  size_t first = b->size - idx;
+  if (first > k)
+    first = k;
+  memcpy(dst, b->buf + idx * b->elemSize, first * b->elemSize);
+  memcpy(dst + first * b->elemSize, b->buf, (k - first) * b->elemSize);
+  atomic_store_explicit(&b->head, head + k, memory_order_release);
+  wakeWaiters(&b->notFull, b->strategy);
+  TRACE(b, TRACE_GET, (int)k);
+  return (int)k;
+}
+
+void initSpscBuffer(struct SpscBuffer *b, int size, int elemSize, enum WaitStrategy strategy) {
+  // round capacity up to the next power of two so that indices can be masked
+  size_t capacity = 1;
+  while (capacity < (size_t)size)
+    capacity <<= 1;
+  atomic_init(&b->head, 0);
+  atomic_init(&b->tail, 0);
+  b->cachedHead = 0;
+  b->cachedTail = 0;
+  initWaitQueue(&b->notEmpty);
+  initWaitQueue(&b->notFull);
+  b->strategy = strategy;
+  b->elemSize = elemSize;
+  b->size = capacity;
+  b->mask = capacity - 1;
+  b->buf = (char*)malloc((size_t)elemSize * capacity);
+  // if memory allocation failed
+  if (b->buf == NULL)
+    // exit program with -1
+    exit(-1);
+}
+
+void destroySpscBuffer(struct SpscBuffer *b) {
+  free(b->buf);
+}
+
+void *spscProducerFunc(void *param) {
+  struct SpscBuffer* b = (struct SpscBuffer*)param;
+  int i;
+  for (i = 0; i < SPSC_ITEMS; ++i) {
+    char c = (char)(i % 26) + 97;
+    spscPut(b, &c);
+  }
+  return NULL;
+}
+
+void *spscConsumerFunc(void *param) {
+  struct SpscBuffer* b = (struct SpscBuffer*)param;
+  int i, errors = 0;
+  for (i = 0; i < SPSC_ITEMS; ++i) {
+    char c;
+    spscGet(b, &c);
+    // items have to arrive in the order they were put
+    if (c != (char)(i % 26) + 97)
+      ++errors;
+  }
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  else
+    printf("no errors occured.\n");
+  return NULL;
+}
+
+// push SPSC_ITEMS through the lock-free buffer and report the throughput
+void runSpsc(int size, enum WaitStrategy strategy) {
+  pthread_t producer, consumer;
+  struct timeval start, end;
+
+  struct SpscBuffer b;
+  initSpscBuffer(&b, size, sizeof(char), strategy);
+
+  gettimeofday(&start, NULL);
+  pthread_create( &producer, NULL, spscProducerFunc, &b );
+  pthread_create( &consumer, NULL, spscConsumerFunc, &b );
+  pthread_join( producer, NULL );
+  pthread_join( consumer, NULL );
+  gettimeofday(&end, NULL);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  printf("spsc: %d items in %f s (%.0f items/s)\n", SPSC_ITEMS, seconds, SPSC_ITEMS / seconds);
+
+  destroySpscBuffer(&b);
+}
+
+// end lock-free SPSC section
+// ######################################################
+
+// ######################################################
+// Start lock-free MPMC section
+
+/*
+Bounded array queue for any number of producer and consumer threads (D. Vyukov).
+Every slot carries a sequence number which tells whose turn it is:
+  seq == pos      the slot is free for the producer that claims position pos
+  seq == pos + 1  the slot holds the item of position pos for a consumer
+A thread claims a position with one CAS on enqueuePos/dequeuePos and then
+hands the slot over with a release store of the sequence number.
+Unlike put()/get() there is no signal that can wake the wrong kind of thread.
+*/
+struct MpmcCell {
+  atomic_size_t seq;
+  // the item of elemSize bytes directly follows the sequence number
+  _Alignas(8) char data[];
+};
+
+struct MpmcBuffer {
+  // producers compete on enqueuePos, consumers on dequeuePos: keep them apart
+  _Alignas(CACHE_LINE) atomic_size_t enqueuePos;
+  // producers sleep here while the buffer is full
+  struct WaitQueue notFull;
+  _Alignas(CACHE_LINE) atomic_size_t dequeuePos;
+  // consumers sleep here while the buffer is empty
+  struct WaitQueue notEmpty;
+  // shared read-only state
+  _Alignas(CACHE_LINE) char *cells;
+  enum WaitStrategy strategy;
+  // distance between two cells in bytes
+  size_t cellSize;
+  size_t elemSize;
+  size_t size;
+  size_t mask;
+};
+
+static inline struct MpmcCell *mpmcCell(struct MpmcBuffer *b, size_t pos) {
+  return (struct MpmcCell*)(b->cells + (pos & b->mask) * b->cellSize);
+}
+
+// the cell a slot handed out by mpmcPutReserve/mpmcGetReserve belongs to
+static inline struct MpmcCell *mpmcSlotCell(const void *slot) {
+  return (struct MpmcCell*)((char*)slot - offsetof(struct MpmcCell, data));
+}
+
+void *mpmcPutReserve(struct MpmcBuffer *b) {
+  struct MpmcCell *cell;
+  size_t pos = atomic_load_explicit(&b->enqueuePos, memory_order_relaxed);
+  for (;;) {
+    cell = mpmcCell(b, pos);
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      // slot is free: try to claim position pos, on failure pos holds the current value
+      if (atomic_compare_exchange_weak_explicit(&b->enqueuePos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // slot still holds the item of the previous round: buffer is full, wait until it is freed
+      WAIT_WHILE(&b->notFull, b->strategy,
+                 (long)atomic_load_explicit(&cell->seq, memory_order_acquire) - (long)pos < 0);
+      pos = atomic_load_explicit(&b->enqueuePos, memory_order_relaxed);
+    } else {
+      // another producer claimed pos in the meantime
+      pos = atomic_load_explicit(&b->enqueuePos, memory_order_relaxed);
+    }
+  }
+  // position pos is ours now, the producer writes its item directly into the cell
+  return cell->data;
+}
+
+void mpmcPutCommit(struct MpmcBuffer *b, void *slot) {
+  struct MpmcCell *cell = mpmcSlotCell(slot);
+  // nobody else touches a claimed cell, so its sequence number is still pos
+  size_t pos = atomic_load_explicit(&cell->seq, memory_order_relaxed);
+  // hand the slot over to the consumer of position pos
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  wakeWaiters(&b->notEmpty, b->strategy);
+  TRACE(b, TRACE_PUT, 1);
+}
+
+const void *mpmcGetReserve(struct MpmcBuffer *b) {
+  struct MpmcCell *cell;
+  size_t pos = atomic_load_explicit(&b->dequeuePos, memory_order_relaxed);
+  for (;;) {
+    cell = mpmcCell(b, pos);
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)(pos + 1);
+    if (diff == 0) {
+      // slot is filled: try to claim position pos
+      if (atomic_compare_exchange_weak_explicit(&b->dequeuePos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // producer of position pos has not finished yet: buffer is empty, wait until it is filled
+      WAIT_WHILE(&b->notEmpty, b->strategy,
+                 (long)atomic_load_explicit(&cell->seq, memory_order_acquire) - (long)(pos + 1) < 0);
+      pos = atomic_load_explicit(&b->dequeuePos, memory_order_relaxed);
+    } else {
+      // another consumer claimed pos in the meantime
+      pos = atomic_load_explicit(&b->dequeuePos, memory_order_relaxed);
+    }
+  }
+  // position pos is ours now, the consumer reads the item in place
+  return cell->data;
+}
+
+void mpmcGetCommit(struct MpmcBuffer *b, const void *slot) {
+  struct MpmcCell *cell = mpmcSlotCell(slot);
+  // the sequence number of a claimed filled cell is pos + 1
+  size_t seq = atomic_load_explicit(&cell->seq, memory_order_relaxed);
+  // free the slot for the producer of the next round (pos + size)
+  atomic_store_explicit(&cell->seq, seq + b->mask, memory_order_release);
+  wakeWaiters(&b->notFull, b->strategy);
+  TRACE(b, TRACE_GET, 1);
+}
+
+void mpmcPut(struct MpmcBuffer *b, const void *item) {
+  void *slot = mpmcPutReserve(b);
+  memcpy(slot, item, b->elemSize);
+  mpmcPutCommit(b, slot);
+}
+
+void mpmcGet(struct MpmcBuffer *b, void *item) {
+  const void *slot = mpmcGetReserve(b);
+  memcpy(item, slot, b->elemSize);
+  mpmcGetCommit(b, slot);
+}
+
+void initMpmcBuffer(struct MpmcBuffer *b, int size, int elemSize, enum WaitStrategy strategy) {
+  // round capacity up to the next power of two so that indices can be masked
+  size_t capacity = 2;
+  while (capacity < (size_t)size)
+    capacity <<= 1;
+  initWaitQueue(&b->notFull);
+  initWaitQueue(&b->notEmpty);
+  b->strategy = strategy;
+  b->elemSize = elemSize;
+  // cells are 8 byte aligned so that the sequence number of every cell is
+  b->cellSize = (sizeof(struct MpmcCell) + elemSize + 7) & ~(size_t)7;
+  b->size = capacity;
+  b->mask = capacity - 1;
+  b->cells = (char*)malloc(b->cellSize * capacity);
+  // if memory allocation failed
+  if (b->cells == NULL)
+    // exit program with -1
+    exit(-1);
+  // slot i is free for the producer of position i
+  size_t i;
+  for (i = 0; i < capacity; ++i)
+    atomic_init(&mpmcCell(b, i)->seq, i);
+  atomic_init(&b->enqueuePos, 0);
+  atomic_init(&b->dequeuePos, 0);
+}
+
+void destroyMpmcBuffer(struct MpmcBuffer *b) {
+  free(b->cells);
+}
+
+struct MpmcStress {
+  struct MpmcBuffer *b;
+  int producers;
+  long itemsPerProducer;
+  // number of items the consumers still have to take
+  atomic_long remaining;
+  // how often every item has been taken
+  atomic_uchar *seen;
+  // items taken out of order (per producer)
+  atomic_long errors;
+};
+
+struct MpmcWorker {
+  struct MpmcStress *s;
+  int id;
+};
+
+void *mpmcProducerFunc(void *param) {
+  struct MpmcWorker *w = (struct MpmcWorker*)param;
+  long i;
+  // item values are unique over all producers
+  for (i = 0; i < w->s->itemsPerProducer; ++i) {
+    long item = w->id * w->s->itemsPerProducer + i;
+    mpmcPut(w->s->b, &item);
+  }
+  return NULL;
+}
+
+void *mpmcConsumerFunc(void *param) {
+  struct MpmcWorker *w = (struct MpmcWorker*)param;
+  struct MpmcStress *s = w->s;
+  long last[MPMC_MAX_THREADS];
+  int p;
+  for (p = 0; p < s->producers; ++p)
+    last[p] = -1;
+  // take a ticket before each get, so that no consumer waits for an item that never comes
+  while (atomic_fetch_sub(&s->remaining, 1) > 0) {
+    long item;
+    mpmcGet(s->b, &item);
+    atomic_fetch_add(&s->seen[item], 1);
+    // items of one producer have to arrive in the order they were put
+    p = item / s->itemsPerProducer;
+    if (item <= last[p])
+      atomic_fetch_add(&s->errors, 1);
+    last[p] = item;
+  }
+  return NULL;
+}
+
+// run producers/consumers pairs over one MPMC buffer, check every item arrived exactly once
+void runMpmcStress(int size, int producers, int consumers, enum WaitStrategy strategy) {
+  pthread_t threads[2 * MPMC_MAX_THREADS];
+  struct MpmcWorker workers[2 * MPMC_MAX_THREADS];
+  struct timeval start, end;
+  int i;
+
+  struct MpmcBuffer b;
+  initMpmcBuffer(&b, size, sizeof(long), strategy);
+
+  struct MpmcStress s;
+  s.b = &b;
+  s.producers = producers;
+  s.itemsPerProducer = MPMC_ITEMS / producers;
+  long total = s.itemsPerProducer * producers;
+  atomic_init(&s.remaining, total);
+  atomic_init(&s.errors, 0);
+  s.seen = (atomic_uchar*)calloc(total, sizeof(atomic_uchar));
+  if (s.seen == NULL)
+    exit(-1);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < producers + consumers; ++i) {
+    workers[i].s = &s;
+    workers[i].id = (i < producers) ? i : i - producers;
+    pthread_create( &threads[i], NULL, (i < producers) ? mpmcProducerFunc : mpmcConsumerFunc, &workers[i] );
+  }
+  for (i = 0; i < producers + consumers; ++i)
+    pthread_join( threads[i], NULL );
+  gettimeofday(&end, NULL);
+
+  // every item must have been taken exactly once: no loss, no duplicate
+  long lost = 0, duplicated = 0, k;
+  for (k = 0; k < total; ++k) {
+    unsigned char n = atomic_load(&s.seen[k]);
+    if (n == 0)
+      ++lost;
+    else if (n > 1)
+      ++duplicated;
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  printf("mpmc %2dP/%2dC: %ld items in %f s (%.0f items/s), lost %ld, duplicated %ld, out of order %ld\n",
+         producers, consumers, total, seconds, total / seconds, lost, duplicated, atomic_load(&s.errors));
+  if (lost + duplicated + atomic_load(&s.errors) > 0)
+    printf("errors occured.\n");
+  else
+    printf("no errors occured.\n");
+
+  free(s.seen);
+  destroyMpmcBuffer(&b);
+}
+
+// end lock-free MPMC section
+// ######################################################
+
+// ######################################################
+// Start bulk transfer section
+
+// a bulk run moves records either through the mutex buffer or through the SPSC buffer
+struct BulkRun {
+  struct Buffer *b;
+  struct SpscBuffer *spsc;
+};
+
+// content of char i of record r
+static inline char recordChar(int r, int i) {
+  return (char)((r + i) % 26) + 97;
+}
+
+void *bulkProducerFunc(void *param) {
+  struct BulkRun *run = (struct BulkRun*)param;
+  char record[BULK_RECORD_LEN];
+  int r, i;
+  for (r = 0; r < BULK_RECORDS; ++r) {
+    for (i = 0; i < BULK_RECORD_LEN; ++i)
+      record[i] = recordChar(r, i);
+    // one synchronization per record instead of one per char
+    if (run->spsc != NULL)
+      spscPutN(run->spsc, record, BULK_RECORD_LEN);
+    else
+      putN(run->b, record, BULK_RECORD_LEN);
+  }
+  return NULL;
+}
+
+void *bulkConsumerFunc(void *param) {
+  struct BulkRun *run = (struct BulkRun*)param;
+  char chunk[BULK_RECORD_LEN];
+  long received = 0, total = (long)BULK_RECORDS * BULK_RECORD_LEN;
+  int errors = 0;
+  while (received < total) {
+    int i, k;
+    if (run->spsc != NULL)
+      k = spscGetN(run->spsc, chunk, BULK_RECORD_LEN);
+    else
+      k = getN(run->b, chunk, BULK_RECORD_LEN);
+    // a chunk may end in the middle of a record
+    for (i = 0; i < k; ++i, ++received)
+      if (chunk[i] != recordChar(received / BULK_RECORD_LEN, received % BULK_RECORD_LEN))
+        ++errors;
+  }
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  else
+    printf("no errors occured.\n");
+  return NULL;
+}
+
+// push BULK_RECORDS records through both buffers using putN/getN and report the throughput
+void runBulk(int size, enum WaitStrategy strategy) {
+  pthread_t producer, consumer;
+  struct timeval start, end;
+  struct Buffer b;
+  struct SpscBuffer spsc;
+  int useSpsc;
+
+  initBuffer(&b, size, sizeof(char), strategy);
+  initSpscBuffer(&spsc, size, sizeof(char), strategy);
+
+  for (useSpsc = 0; useSpsc <= 1; ++useSpsc) {
+    struct BulkRun run = { &b, useSpsc ? &spsc : NULL };
+    gettimeofday(&start, NULL);
+    pthread_create( &producer, NULL, bulkProducerFunc, &run );
+    pthread_create( &consumer, NULL, bulkConsumerFunc, &run );
+    pthread_join( producer, NULL );
+    pthread_join( consumer, NULL );
+    gettimeofday(&end, NULL);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s bulk: %d records of %d chars in %f s (%.0f records/s)\n", useSpsc ? "spsc" : "mutex",
+           BULK_RECORDS, BULK_RECORD_LEN, seconds, BULK_RECORDS / seconds);
+  }
+
+  destroySpscBuffer(&spsc);
+  destroyBuffer(&b);
+}
+
+// end bulk transfer section
+// ######################################################
+
+// ######################################################
+// Start zero-copy record section
+
+// fixed-size message as it is passed between pipeline stages
+struct Message {
+  long seq;
+  char text[56];
+};
+
+// a record run moves messages through one of the three buffer kinds
+struct RecordRun {
+  struct Buffer *b;
+  struct SpscBuffer *spsc;
+  struct MpmcBuffer *mpmc;
+};
+
+void *recordProducerFunc(void *param) {
+  struct RecordRun *run = (struct RecordRun*)param;
+  long i;
+  for (i = 0; i < RECORD_ITEMS; ++i) {
+    // build the message directly inside the buffer slot, no intermediate copy
+    struct Message *m;
+    if (run->spsc != NULL)
+      m = (struct Message*)spscPutReserve(run->spsc);
+    else if (run->mpmc != NULL)
+      m = (struct Message*)mpmcPutReserve(run->mpmc);
+    else
+      m = (struct Message*)putReserve(run->b);
+    m->seq = i;
+    m->text[0] = (char)(i % 26) + 97;
+    if (run->spsc != NULL)
+      spscPutCommit(run->spsc);
+    else if (run->mpmc != NULL)
+      mpmcPutCommit(run->mpmc, m);
+    else
+      putCommit(run->b);
+  }
+  return NULL;
+}
+
+void *recordConsumerFunc(void *param) {
+  struct RecordRun *run = (struct RecordRun*)param;
+  long i, errors = 0;
+  for (i = 0; i < RECORD_ITEMS; ++i) {
+    // read the message in place
+    const struct Message *m;
+    if (run->spsc != NULL)
+      m = (const struct Message*)spscGetReserve(run->spsc);
+    else if (run->mpmc != NULL)
+      m = (const struct Message*)mpmcGetReserve(run->mpmc);
+    else
+      m = (const struct Message*)getReserve(run->b);
+    if (m->seq != i || m->text[0] != (char)(i % 26) + 97)
+      ++errors;
+    if (run->spsc != NULL)
+      spscGetCommit(run->spsc);
+    else if (run->mpmc != NULL)
+      mpmcGetCommit(run->mpmc, m);
+    else
+      getCommit(run->b);
+  }
+  if (errors > 0)
+    printf("%ld errors occured.\n", errors);
+  else
+    printf("no errors occured.\n");
+  return NULL;
+}
+
+// pass RECORD_ITEMS messages through all three buffers with reserve/commit
+void runRecords(int size, enum WaitStrategy strategy) {
+  pthread_t producer, consumer;
+  struct timeval start, end;
+  struct Buffer b;
+  struct SpscBuffer spsc;
+  struct MpmcBuffer mpmc;
+  int kind;
+
+  initBuffer(&b, size, sizeof(struct Message), strategy);
+  initSpscBuffer(&spsc, size, sizeof(struct Message), strategy);
+  initMpmcBuffer(&mpmc, size, sizeof(struct Message), strategy);
+
+  for (kind = 0; kind < 3; ++kind) {
+    struct RecordRun run = { &b, (kind == 1) ? &spsc : NULL, (kind == 2) ? &mpmc : NULL };
+    gettimeofday(&start, NULL);
+    pthread_create( &producer, NULL, recordProducerFunc, &run );
+    pthread_create( &consumer, NULL, recordConsumerFunc, &run );
+    pthread_join( producer, NULL );
+    pthread_join( consumer, NULL );
+    gettimeofday(&end, NULL);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    const char *names[] = { "mutex", "spsc", "mpmc" };
+    printf("%s records: %d messages of %zu bytes in %f s (%.0f messages/s)\n", names[kind],
+           RECORD_ITEMS, sizeof(struct Message), seconds, RECORD_ITEMS / seconds);
+  }
+
+  destroyMpmcBuffer(&mpmc);
+  destroySpscBuffer(&spsc);
+  destroyBuffer(&b);
+}
+
+// end zero-copy record section
+// ######################################################
+
+// ######################################################
+// Start benchmark section
+
+enum BenchImpl { BENCH_MUTEX, BENCH_SPSC, BENCH_MPMC, BENCH_ALL };
+
+struct BenchConfig {
+  enum BenchImpl impl;
+  int producers;
+  int consumers;
+  int capacity;
+  // bytes per item, at least the 8 byte timestamp
+  int itemSize;
+  double seconds;
+  enum WaitStrategy strategy;
+  // pin thread i to cpu i modulo the number of cpus
+  int pin;
+};
+
+// one buffer of the implementation under test
+struct BenchBuffer {
+  enum BenchImpl impl;
+  struct Buffer b;
+  struct SpscBuffer spsc;
+  struct MpmcBuffer mpmc;
+};
+
+// zero-copy access to whichever buffer is tested, so that every implementation does the same work
+static inline void *benchPutReserve(struct BenchBuffer *bb) {
+  switch (bb->impl) {
+    case BENCH_SPSC: return spscPutReserve(&bb->spsc);
+    case BENCH_MPMC: return mpmcPutReserve(&bb->mpmc);
+    default: return putReserve(&bb->b);
+  }
+}
+
+static inline void benchPutCommit(struct BenchBuffer *bb, void *slot) {
+  switch (bb->impl) {
+    case BENCH_SPSC: spscPutCommit(&bb->spsc); break;
+    case BENCH_MPMC: mpmcPutCommit(&bb->mpmc, slot); break;
+    default: putCommit(&bb->b);
+  }
+}
+
+static inline const void *benchGetReserve(struct BenchBuffer *bb) {
+  switch (bb->impl) {
+    case BENCH_SPSC: return spscGetReserve(&bb->spsc);
+    case BENCH_MPMC: return mpmcGetReserve(&bb->mpmc);
+    default: return getReserve(&bb->b);
+  }
+}
+
+static inline void benchGetCommit(struct BenchBuffer *bb, const void *slot) {
+  switch (bb->impl) {
+    case BENCH_SPSC: spscGetCommit(&bb->spsc); break;
+    case BENCH_MPMC: mpmcGetCommit(&bb->mpmc, slot); break;
+    default: getCommit(&bb->b);
+  }
+}
+
+/*
+Latency histogram with 16 linear sub-buckets per power of two (about 6% resolution).
+Values below 16 ns get a bucket of their own.
+*/
+static inline int latencyBucket(uint64_t ns) {
+  if (ns < 16)
+    return (int)ns;
+  int msb = 63 - __builtin_clzll(ns);
+  return (msb - 3) * 16 + (int)((ns >> (msb - 4)) & 15);
+}
+
+// smallest latency that falls into bucket
+static uint64_t bucketValue(int bucket) {
+  if (bucket < 16)
+    return bucket;
+  int msb = bucket / 16 + 3;
+  return ((uint64_t)16 + bucket % 16) << (msb - 4);
+}
+
+// latency below which the fraction q of all items lies
+static uint64_t percentile(const uint64_t *histogram, uint64_t count, double q) {
+  uint64_t rank = (uint64_t)(q * count), seen = 0;
+  int i;
+  for (i = 0; i < BENCH_BUCKETS; ++i) {
+    seen += histogram[i];
+    if (seen > rank)
+      return bucketValue(i);
+  }
+  return bucketValue(BENCH_BUCKETS - 1);
+}
+
+struct BenchWorker {
+  struct BenchBuffer *bb;
+  atomic_int *stop;
+  int cpu;
+  int itemSize;
+  // items moved by this thread
+  uint64_t items;
+  // consumers only: enqueue-to-dequeue latencies
+  uint64_t histogram[BENCH_BUCKETS];
+};
+
+static void pinThread(int cpu) {
+#ifdef __linux__
+  if (cpu < 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+void *benchProducerFunc(void *param) {
+  struct BenchWorker *w = (struct BenchWorker*)param;
+  pinThread(w->cpu);
+  while (!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+    // the item is written in place: timestamp first, the rest of the item is payload
+    char *slot = (char*)benchPutReserve(w->bb);
+    uint64_t now = nowNs();
+    memcpy(slot, &now, sizeof(now));
+    memset(slot + sizeof(now), (int)w->items, w->itemSize - sizeof(now));
+    benchPutCommit(w->bb, slot);
+    ++w->items;
+  }
+  return NULL;
+}
+
+void *benchConsumerFunc(void *param) {
+  struct BenchWorker *w = (struct BenchWorker*)param;
+  pinThread(w->cpu);
+  for (;;) {
+    const char *slot = (const char*)benchGetReserve(w->bb);
+    uint64_t stamp;
+    memcpy(&stamp, slot, sizeof(stamp));
+    benchGetCommit(w->bb, slot);
+    // a zero timestamp tells the consumer to stop
+    if (stamp == 0)
+      break;
+    ++w->histogram[latencyBucket(nowNs() - stamp)];
+    ++w->items;
+  }
+  return NULL;
+}
+
+static const char *benchImplName(enum BenchImpl impl) {
+  switch (impl) {
+    case BENCH_SPSC: return "spsc";
+    case BENCH_MPMC: return "mpmc";
+    default: return "mutex";
+  }
+}
+
+// run one implementation for cfg->seconds and print throughput and latency percentiles
+void runBenchImpl(const struct BenchConfig *cfg, enum BenchImpl impl) {
+  static struct BenchWorker workers[2 * BENCH_MAX_THREADS];
+  pthread_t threads[2 * BENCH_MAX_THREADS];
+  struct BenchBuffer bb;
+  atomic_int stop;
+  int i, n = cfg->producers + cfg->consumers;
+
+  bb.impl = impl;
+  if (impl == BENCH_SPSC)
+    initSpscBuffer(&bb.spsc, cfg->capacity, cfg->itemSize, cfg->strategy);
+  else if (impl == BENCH_MPMC)
+    initMpmcBuffer(&bb.mpmc, cfg->capacity, cfg->itemSize, cfg->strategy);
+  else
+    initBuffer(&bb.b, cfg->capacity, cfg->itemSize, cfg->strategy);
+  atomic_init(&stop, 0);
+
+  uint64_t start = nowNs();
+  for (i = 0; i < n; ++i) {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    workers[i].bb = &bb;
+    workers[i].stop = &stop;
+    workers[i].itemSize = cfg->itemSize;
+    workers[i].cpu = cfg->pin ? i : -1;
+    pthread_create( &threads[i], NULL, (i < cfg->producers) ? benchProducerFunc : benchConsumerFunc, &workers[i] );
+  }
+  usleep( (useconds_t)(cfg->seconds * 1e6) );
+  atomic_store(&stop, 1);
+  for (i = 0; i < cfg->producers; ++i)
+    pthread_join( threads[i], NULL );
+  // producers are done: the main thread sends one stop item per consumer
+  for (i = 0; i < cfg->consumers; ++i) {
+    char *slot = (char*)benchPutReserve(&bb);
+    memset(slot, 0, cfg->itemSize);
+    benchPutCommit(&bb, slot);
+  }
+  for (i = cfg->producers; i < n; ++i)
+    pthread_join( threads[i], NULL );
+  double seconds = (nowNs() - start) / 1e9;
+
+  // merge the histograms of all consumers
+  uint64_t histogram[BENCH_BUCKETS] = {0}, items = 0;
+  int k;
+  for (i = cfg->producers; i < n; ++i) {
+    items += workers[i].items;
+    for (k = 0; k < BENCH_BUCKETS; ++k)
+      histogram[k] += workers[i].histogram[k];
+  }
+  printf("%-5s %2dP/%2dC size %5d item %4dB: %12.0f items/s, latency p50 %8llu ns, p99 %8llu ns, p999 %8llu ns\n",
+         benchImplName(impl), cfg->producers, cfg->consumers, cfg->capacity, cfg->itemSize, items / seconds,
+         (unsigned long long)percentile(histogram, items, 0.5),
+         (unsigned long long)percentile(histogram, items, 0.99),
+         (unsigned long long)percentile(histogram, items, 0.999));
+
+  if (impl == BENCH_SPSC)
+    destroySpscBuffer(&bb.spsc);
+  else if (impl == BENCH_MPMC)
+    destroyMpmcBuffer(&bb.mpmc);
+  else
+    destroyBuffer(&bb.b);
+}
+
+/*
+bbuffer bench [-i mutex|spsc|mpmc|all] [-p producers] [-c consumers] [-n capacity]
+              [-s item size] [-d seconds] [-w spin|yield|park] [-a]
+No sleeps: producers put timestamped items as fast as they can for the given duration.
+-a pins thread i to cpu i (modulo the number of cpus).
+*/
+int runBench(int argc, char **argv) {
+  struct BenchConfig cfg = { BENCH_ALL, 1, 1, 1024, (int)sizeof(uint64_t), 2.0, WAIT_YIELD, 0 };
+  int opt;
+  while ((opt = getopt(argc, argv, "i:p:c:n:s:d:w:a")) != -1) {
+    switch (opt) {
+      case 'i':
+        cfg.impl = (strcmp(optarg, "mutex") == 0) ? BENCH_MUTEX :
+                   (strcmp(optarg, "spsc") == 0) ? BENCH_SPSC :
+                   (strcmp(optarg, "mpmc") == 0) ? BENCH_MPMC : BENCH_ALL;
+        break;
+      case 'p': cfg.producers = atoi(optarg); break;
+      case 'c': cfg.consumers = atoi(optarg); break;
+      case 'n': cfg.capacity = atoi(optarg); break;
+      case 's': cfg.itemSize = atoi(optarg); break;
+      case 'd': cfg.seconds = atof(optarg); break;
+      case 'w': cfg.strategy = parseWaitStrategy(optarg); break;
+      case 'a': cfg.pin = 1; break;
+      default:
+        printf("usage: bbuffer bench [-i mutex|spsc|mpmc|all] [-p producers] [-c consumers] [-n capacity]"
+               " [-s item size] [-d seconds] [-w spin|yield|park] [-a]\n");
+        return 1;
+    }
+  }
+  if (cfg.producers < 1 || cfg.producers > BENCH_MAX_THREADS ||
+      cfg.consumers < 1 || cfg.consumers > BENCH_MAX_THREADS || cfg.capacity < 1) {
+    printf("1 to %d producers and consumers and a positive capacity are required\n", BENCH_MAX_THREADS);
+    return 1;
+  }
+  // every item carries its timestamp
+  if (cfg.itemSize < (int)sizeof(uint64_t))
+    cfg.itemSize = sizeof(uint64_t);
+
+  int impl;
+  for (impl = BENCH_MUTEX; impl <= BENCH_MPMC; ++impl) {
+    if (cfg.impl != BENCH_ALL && cfg.impl != (enum BenchImpl)impl)
+      continue;
+    // the SPSC buffer only supports one producer and one consumer
+    if (impl == BENCH_SPSC && (cfg.producers != 1 || cfg.consumers != 1)) {
+      if (cfg.impl == BENCH_SPSC)
+        printf("spsc requires -p 1 -c 1\n");
+      continue;
+    }
+    runBenchImpl(&cfg, (enum BenchImpl)impl);
+  }
+  return 0;
+}
+
+// end benchmark section
+// ######################################################
+
 int getRandSleepTime() {
   return rand() % 100 + 750000;
 }
@@ -122,7 +1461,7 @@ void *producerFunc(void *param) {
   for (i = 0; i < MAX_ITER; ++i) {
     // get random small ascii character
     char c = (char)(26 * (rand() / (RAND_MAX + 1.0))) + 97;
-    put(b, c);
+    put(b, &c);
     usleep( getRandSleepTime()*2 );
   }
   return NULL;
@@ -132,7 +1471,9 @@ void *consumerFunc(void *param) {
   struct Buffer* b = (struct Buffer*)param;
   int i;
   for (i = 0; i < MAX_ITER; ++i) {
-    printf("%c\n", get(b));
+    char c;
+    get(b, &c);
+    printf("%c\n", c);
     usleep( getRandSleepTime());
   };
   return NULL;
@@ -141,10 +1482,44 @@ void *consumerFunc(void *param) {
 int main(int argc, char **argv) {
   pthread_t producer, consumer;
 
+  // only has an effect if compiled with -DBUFFER_TRACE
+  initTrace();
+
+  // "bbuffer bench ..." compares the buffer implementations, see runBench for the options
+  if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    return runBench(argc - 1, argv + 1);
+
+  // optional arguments of the measuring modes: buffer size and wait strategy (spin|yield|park)
+  int size = (argc > 2) ? atoi(argv[2]) : 1024;
+  enum WaitStrategy strategy = (argc > 3) ? parseWaitStrategy(argv[3]) : WAIT_YIELD;
+
+  // "bbuffer spsc" measures the lock-free single producer/single consumer buffer
+  if (argc > 1 && strcmp(argv[1], "spsc") == 0) {
+    runSpsc(size, strategy);
+    return 0;
+  }
+  // "bbuffer bulk" moves whole records with putN/getN through the mutex and the SPSC buffer
+  if (argc > 1 && strcmp(argv[1], "bulk") == 0) {
+    runBulk(size, strategy);
+    return 0;
+  }
+  // "bbuffer records" builds and reads 64 byte messages in place with reserve/commit
+  if (argc > 1 && strcmp(argv[1], "records") == 0) {
+    runRecords(size, strategy);
+    return 0;
+  }
+  // "bbuffer mpmc" stress tests the MPMC buffer with 1+1 up to 16+16 threads
+  if (argc > 1 && strcmp(argv[1], "mpmc") == 0) {
+    int n;
+    for (n = 1; n <= MPMC_MAX_THREADS / 2; n *= 2)
+      runMpmcStress(size, n, n, strategy);
+    return 0;
+  }
+
   srand(time(NULL));
 
   struct Buffer b;
-  initBuffer(&b, 10);
+  initBuffer(&b, 10, sizeof(char), WAIT_PARK);
 
   pthread_create( &producer, NULL, producerFunc, &b );
   pthread_create( &consumer, NULL, consumerFunc, &b );
@@ -2,6 +2,28 @@
 #include <fstream>
 #include <cmath>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <climits>
+#include <cctype>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// thread pool shared with the other kernels
+#include "../parallel_reduce/wsched.h"
 
 typedef struct {
   unsigned char r;
@@ -21,6 +43,7 @@ void writePPM (Pixel *pixels, const char *filename, int width, int height) {
 }
 
 // Pointer returned must be explicitly freed!
+// Expects the header layout writePPM writes; gauss uses mapPPM, this is the baseline of -B.
 Pixel* readPPM (const char* filename, int* width, int* height) {
   std::ifstream inputFile(filename, std::ios::binary);
   
@@ -48,68 +71,2152 @@ Pixel* readPPM (const char* filename, int* width, int* height) {
 
 using namespace std;
 
-void calculateWeights(float weights[5][5]) {
-  float sigma = 1.0;
-  float r, s = 2.0 * sigma * sigma;
+// ######################################################
+// Start PPM file section
+
+/*
+Header of a binary PPM (P6) or PGM (P5), byte by byte from next(), which returns EOF at the
+end: the magic number, width, height and maxval separated by whitespace, with comments from #
+to the end of a line anywhere in between, and a single whitespace byte before the pixels.
+Only maxval 255 (one byte per channel) is supported. channels is 3 for P6 and 1 for P5.
+*/
+template <typename Next>
+bool parsePPMHeader(Next next, int* width, int* height, int* channels) {
+  int values[3];
+  if (next() != 'P')
+    return false;
+  int magic = next();
+  if (magic != '6' && magic != '5')
+    return false;
+  for (int i = 0; i < 3; ++i) {
+    int c = next();
+    while (isspace(c) || c == '#') {
+      if (c == '#') {
+        while (c != '\n' && c != EOF)
+          c = next();
+      }
+      c = next();
+    }
+    if (!isdigit(c))
+      return false;
+    values[i] = 0;
+    for (; isdigit(c); c = next()) {
+      if (values[i] > (INT_MAX - 9) / 10)
+        return false;
+      values[i] = 10 * values[i] + (c - '0');
+    }
+    if (!isspace(c))
+      return false;
+  }
+  *width = values[0];
+  *height = values[1];
+  *channels = (magic == '6') ? 3 : 1;
+  return *width > 0 && *height > 0 && values[2] == 255;
+}
+
+// header of a P6 file, leaves file at the first pixel
+bool readPPMHeader(FILE* file, int* width, int* height) {
+  int channels;
+  return parsePPMHeader([&] { return getc(file); }, width, height, &channels) && channels == 3;
+}
+
+// a PPM or PGM file mapped into memory, pixels points to the payload inside the mapping
+struct MappedImage {
+  int width, height, channels;
+  unsigned char* pixels;
+  void* map;
+  size_t mapBytes;
+  dev_t device;        // file of mapPPM, to recognize it as the output of createPPM
+  ino_t inode;
+  string tempName;     // createPPM over its own input: written here, renamed to finalName by unmapPPM
+  string finalName;
+};
+
+/*
+Maps a P6 or P5 file read-only; the pixels are used in place without copying. The kernel is
+told that the file is read from start to end, so it reads ahead generously.
+*/
+bool mapPPM(const char* filename, MappedImage* image) {
+  int fd = open(filename, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+    cerr << "could not open " << filename << endl;
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  image->mapBytes = info.st_size;
+  image->device = info.st_dev;
+  image->inode = info.st_ino;
+  image->tempName.clear();
+  image->map = mmap(NULL, image->mapBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image->map == MAP_FAILED) {
+    cerr << "could not map " << filename << endl;
+    return false;
+  }
+  madvise(image->map, image->mapBytes, MADV_SEQUENTIAL);
+  madvise(image->map, image->mapBytes, MADV_WILLNEED);
   
-  // sum is for normalization
-  float sum = 0.0;
+  const unsigned char* data = (const unsigned char*)image->map;
+  size_t offset = 0;
+  auto next = [&]() -> int { return (offset < image->mapBytes) ? data[offset++] : (offset++, EOF); };
+  if (!parsePPMHeader(next, &image->width, &image->height, &image->channels) ||
+      image->mapBytes - min(offset, image->mapBytes) <
+          (size_t)image->channels * image->width * image->height) {
+    cerr << filename << " is not a complete binary PPM or PGM with maxval 255" << endl;
+    munmap(image->map, image->mapBytes);
+    return false;
+  }
+  image->pixels = (unsigned char*)data + offset;
+  return true;
+}
+
+// removes the temporary file of a failed createPPM
+static void discardTemp(MappedImage* image) {
+  if (!image->tempName.empty())
+    unlink(image->tempName.c_str());
+  image->tempName.clear();
+}
+
+/*
+Creates a P6 (channels 3) or P5 (channels 1) file of the final size and maps it for writing,
+the caller fills in the pixels. The blocks are allocated up front where the file system
+supports it, so that writing through the mapping cannot fail with a full disk halfway.
+If filename is the file of source (from mapPPM, may be NULL), truncating it would empty the
+mapping the pixels are read from; the image then goes to a temporary file in the same
+directory, which unmapPPM renames over the source.
+*/
+bool createPPM(const char* filename, int width, int height, int channels, MappedImage* image,
+               const MappedImage* source) {
+  char header[64];
+  int headerBytes = snprintf(header, sizeof(header), "P%c\n%d %d\n255\n", (channels == 3) ? '6' : '5',
+                             width, height);
+  image->width = width;
+  image->height = height;
+  image->channels = channels;
+  image->mapBytes = headerBytes + (size_t)channels * width * height;
+  image->tempName.clear();
+  struct stat info;
+  int fd;
+  if (source != NULL && stat(filename, &info) == 0 && info.st_dev == source->device &&
+      info.st_ino == source->inode) {
+    image->finalName = filename;
+    image->tempName = image->finalName + ".XXXXXX";
+    fd = mkstemp(&image->tempName[0]);
+    if (fd >= 0)
+      fchmod(fd, info.st_mode & 07777);
+    else
+      image->tempName.clear();
+  } else {
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fd < 0 || ftruncate(fd, image->mapBytes) != 0) {
+    cerr << "could not create " << filename << endl;
+    if (fd >= 0)
+      close(fd);
+    discardTemp(image);
+    return false;
+  }
+  int error = posix_fallocate(fd, 0, image->mapBytes);
+  if (error != 0 && error != EINVAL && error != EOPNOTSUPP) {
+    cerr << "not enough space for " << filename << endl;
+    close(fd);
+    discardTemp(image);
+    return false;
+  }
+  image->map = mmap(NULL, image->mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image->map == MAP_FAILED) {
+    cerr << "could not map " << filename << endl;
+    discardTemp(image);
+    return false;
+  }
+  madvise(image->map, image->mapBytes, MADV_SEQUENTIAL);
+  memcpy(image->map, header, headerBytes);
+  image->pixels = (unsigned char*)image->map + headerBytes;
+  return true;
+}
+
+/*
+Unmaps a file from mapPPM or createPPM, the pixels of the latter are written back by the kernel.
+Returns false if a temporary file of createPPM could not replace its source.
+*/
+bool unmapPPM(MappedImage* image) {
+  munmap(image->map, image->mapBytes);
+  image->map = NULL;
+  image->pixels = NULL;
+  if (image->tempName.empty())
+    return true;
+  if (rename(image->tempName.c_str(), image->finalName.c_str()) != 0) {
+    cerr << "could not replace " << image->finalName << endl;
+    discardTemp(image);
+    return false;
+  }
+  image->tempName.clear();
+  return true;
+}
+
+// end PPM file section
+// ######################################################
+
+// weights on each side of the center for sigma: beyond 3 sigma the gaussian is below 1% of its peak
+int defaultRadius(float sigma) {
+  return (int)ceil(3.0f * sigma);
+}
+
+// 1D gaussian with 2*radius+1 weights, normalized to a sum of 1; sigma must be positive
+vector<float> calculateWeights(float sigma, int radius) {
+  vector<float> weights(2 * radius + 1);
+  float s = 2.0f * sigma * sigma;
   
-  // generate weights for 5x5 kernel
-  for (int x = -2; x <= 2; x++)
-  {
-    for(int y = -2; y <= 2; y++)
-    {
-      r = x*x + y*y;
-      weights[x + 2][y + 2] = exp(-(r/s))/(M_PI * s);
-      sum += weights[x + 2][y + 2];
-    }
+  // sum is for normalization
+  float sum = 0.0f;
+  for (int x = -radius; x <= radius; ++x) {
+    weights[x + radius] = exp(-(x*x) / s);
+    sum += weights[x + radius];
   }
   
   // normalize the weights
-  for(int i = 0; i < 5; ++i) {
-    for(int j = 0; j < 5; ++j) {
-      weights[i][j] /= sum;
+  for (int i = 0; i <= 2 * radius; ++i) {
+    weights[i] /= sum;
+  }
+  return weights;
+}
+
+/*
+Fixed-point version of weights: Q16 integers with a sum of exactly 2^16, rounded so that the
+largest remainders are rounded up. A single weight of 1.0 (radius 0) becomes 65535. Zero
+weights at both ends are dropped, so the radius of the result can be smaller than the given one.
+*/
+vector<uint16_t> quantizeWeights(const vector<float>& weights) {
+  int n = (int)weights.size();
+  vector<uint32_t> q(n);
+  vector<pair<float, int>> remainders(n);
+  uint32_t sum = 0;
+  for (int i = 0; i < n; ++i) {
+    float scaled = weights[i] * 65536.0f;
+    q[i] = (uint32_t)scaled;
+    remainders[i] = make_pair(scaled - q[i], i);
+    sum += q[i];
+  }
+  sort(remainders.begin(), remainders.end(), greater<pair<float, int>>());
+  for (int i = 0; sum < 65536 && i < n; ++i, ++sum) {
+    ++q[remainders[i].second];
+  }
+  // they contribute nothing, but would cost time and offset the rounding of the fixed-point kernels
+  int trim = 0;
+  while (trim < n / 2 && q[trim] == 0 && q[n - 1 - trim] == 0) {
+    ++trim;
+  }
+  vector<uint16_t> result(n - 2 * trim);
+  for (int i = trim; i < n - trim; ++i) {
+    result[i - trim] = (uint16_t)min(q[i], 65535u);
+  }
+  return result;
+}
+
+// the most nonzero Q16 weights for which the fixed-point kernels cannot overflow, see RowKernels
+#define MAX_FIXED_TAPS 127
+
+// whether the fixed-point kernels are exact for the quantized weights
+bool fixedWeightsFit(const vector<uint16_t>& weights) {
+  return count_if(weights.begin(), weights.end(), [](uint16_t w) { return w != 0; }) <= MAX_FIXED_TAPS;
+}
+
+// how pixels outside the image are made up
+enum BorderMode {
+  BORDER_CLAMP,   // repeat the edge pixel: aaa|abcd|ddd
+  BORDER_MIRROR,  // reflect at the edge pixel: dcb|abcd|cba
+  BORDER_WRAP,    // continue from the other side: bcd|abcd|abc
+  BORDER_ZERO     // black: 000|abcd|000
+};
+
+// parses clamp, mirror, wrap or zero, returns false for anything else
+bool parseBorderMode(const char* name, BorderMode* mode) {
+  static const char* names[] = {"clamp", "mirror", "wrap", "zero"};
+  for (int i = 0; i < 4; ++i) {
+    if (strcmp(name, names[i]) == 0) {
+      *mode = (BorderMode)i;
+      return true;
     }
   }
+  return false;
 }
 
+// index of the pixel that stands in for coordinate i of 0..n-1, or -1 for a zero pixel
+static inline int borderIndex(int i, int n, BorderMode mode) {
+  if (i >= 0 && i < n)
+    return i;
+  switch (mode) {
+    case BORDER_CLAMP:
+      return (i < 0) ? 0 : n - 1;
+    case BORDER_MIRROR: {
+      // reflections repeat with period 2(n-1), also for radii larger than the image
+      if (n == 1)
+        return 0;
+      int period = 2 * (n - 1);
+      i %= period;
+      if (i < 0)
+        i += period;
+      return (i < n) ? i : period - i;
+    }
+    case BORDER_WRAP:
+      i %= n;
+      return (i < 0) ? i + n : i;
+    default:
+      return -1;
+  }
+}
 
+// rounds a filtered channel back to 0..255
+static inline unsigned char toChannel(float v) {
+  v += 0.5f;
+  return (v <= 0.0f) ? 0 : ((v >= 255.0f) ? 255 : (unsigned char)v);
+}
 
-void gaussFilter(Pixel* image, int width, int height, float weight[5][5]) {
+/*
+Reference 2D convolution with the (2r+1)^2 weights weights[i] * weights[j].
+Reads in and writes out, which must not overlap.
+*/
+void gaussFilter2D(const Pixel* in, Pixel* out, int width, int height, const vector<float>& weights,
+                   BorderMode mode) {
+  int radius = (int)weights.size() / 2;
   
-  for (int x = 0; x < width; ++x) {
-    for (int y = 0; y < height; ++y) {
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
       
-      Pixel new_value; new_value.r = 0; new_value.g = 0; new_value.b = 0;
-      for (int xl = -2; xl <= 2; ++xl) {
-        for (int yl = -2; yl <= 2; ++yl) {
-          new_value.r += image[(x+xl) + (y+yl)*width].r * weight[xl+2][yl+2];
-          new_value.g += image[(x+xl) + (y+yl)*width].g * weight[xl+2][yl+2];
-          new_value.b += image[(x+xl) + (y+yl)*width].b * weight[xl+2][yl+2];
+      float r = 0.0f, g = 0.0f, b = 0.0f;
+      for (int yl = -radius; yl <= radius; ++yl) {
+        int sy = borderIndex(y + yl, height, mode);
+        for (int xl = -radius; xl <= radius; ++xl) {
+          int sx = borderIndex(x + xl, width, mode);
+          if (sx < 0 || sy < 0)
+            continue;
+          float weight = weights[xl + radius] * weights[yl + radius];
+          const Pixel& p = in[sx + sy*width];
+          r += p.r * weight;
+          g += p.g * weight;
+          b += p.b * weight;
         }
       }
-      image[x + y*width] = new_value;
+      out[x + y*width].r = toChannel(r);
+      out[x + y*width].g = toChannel(g);
+      out[x + y*width].b = toChannel(b);
       
     }
   }
   
 }
 
+// ######################################################
+// Start row kernel section
+
+/*
+The two inner loops of the separable filter, on the bytes of a row:
+  horizontal: dst[i] = sum over k of src[i + step*k] * weights[k] for i = 0..n-1
+              (interleaved RGB: step 3 and n = 3 * pixels, the same channel of the next
+              pixel is 3 bytes further, so RGB needs no deinterleaving; a plane: step 1)
+  vertical:   out[i] = toChannel(sum over k of rows[k][i] * weights[k]) for i = 0..n-1
+Every version adds the products in the same order as the scalar one, so all of them give
+the same result as long as the compiler does not contract the multiply-adds.
+
+The fixed-point kernels do the same with Q16 weights (see quantizeWeights) in 16-bit lanes,
+twice as many per register as floats and without conversions:
+  horizontal: dst[i] = taps/2 + sum over k of (src[i + step*k] << 8) * weights[k] >> 16
+              (channel values with 8 fractional bits)
+  vertical:   out[i] = (taps/2 + 128 + sum over k of rows[k][i] * weights[k] >> 16) >> 8
+where taps counts only the nonzero weights (fixedOffset). Each of their products is truncated
+by the high-half multiply, the taps/2 offsets center that error. Since the weights sum up to at
+most 2^16, a horizontal sum is at most 255*256 + taps/2 and a vertical one at most
+255*256 + taps + 128, which fits 16 bits for up to MAX_FIXED_TAPS nonzero weights; more must
+use the float kernels (fixedWeightsFit). All versions are exact integer arithmetic and give
+identical results. Compared to the float kernels the quantized weights and truncated products
+change a channel by at most about taps/512 before the final rounding.
+
+deinterleave and interleave convert n pixels between RGB and three planes (see PlanarImage).
+*/
+struct RowKernels {
+  const char* name;
+  void (*horizontal)(const unsigned char* src, float* dst, size_t n, const float* weights, int step, int taps);
+  void (*vertical)(const float* const* rows, unsigned char* out, size_t n, const float* weights, int taps);
+  void (*horizontalFixed)(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights, int step,
+                          int taps);
+  void (*verticalFixed)(const uint16_t* const* rows, unsigned char* out, size_t n, const uint16_t* weights,
+                        int taps);
+  void (*deinterleave)(const unsigned char* rgb, unsigned char* r, unsigned char* g, unsigned char* b, size_t n);
+  void (*interleave)(const unsigned char* r, const unsigned char* g, const unsigned char* b, unsigned char* rgb,
+                     size_t n);
+};
+
+/*
+Scalar loops for i = begin..n-1, also the tails of the vector versions. Not inlined, so that
+they are not compiled for the target of the caller, where the compiler may contract them into FMA.
+*/
+__attribute__((noinline))
+static void horizontalTail(const unsigned char* src, float* dst, size_t begin, size_t n,
+                           const float* weights, int step, int taps) {
+  for (size_t i = begin; i < n; ++i) {
+    float acc = 0.0f;
+    for (int k = 0; k < taps; ++k) {
+      acc += src[i + step*k] * weights[k];
+    }
+    dst[i] = acc;
+  }
+}
+
+__attribute__((noinline))
+static void verticalTail(const float* const* rows, unsigned char* out, size_t begin, size_t n,
+                         const float* weights, int taps) {
+  for (size_t i = begin; i < n; ++i) {
+    float acc = 0.0f;
+    for (int k = 0; k < taps; ++k) {
+      acc += rows[k][i] * weights[k];
+    }
+    out[i] = toChannel(acc);
+  }
+}
+
+static void horizontalScalar(const unsigned char* src, float* dst, size_t n, const float* weights, int step, int taps) {
+  horizontalTail(src, dst, 0, n, weights, step, taps);
+}
+
+static void verticalScalar(const float* const* rows, unsigned char* out, size_t n, const float* weights, int taps) {
+  verticalTail(rows, out, 0, n, weights, taps);
+}
+
+// the rounding offset taps/2 of the fixed-point kernels, for the taps that contribute
+static inline int fixedOffset(const uint16_t* weights, int taps) {
+  int nonzero = 0;
+  for (int k = 0; k < taps; ++k) {
+    nonzero += weights[k] != 0;
+  }
+  return nonzero / 2;
+}
+
+static inline void horizontalFixedTail(const unsigned char* src, uint16_t* dst, size_t begin, size_t n,
+                                       const uint16_t* weights, int step, int taps) {
+  uint16_t offset = fixedOffset(weights, taps);
+  for (size_t i = begin; i < n; ++i) {
+    uint16_t acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      acc += ((uint32_t)src[i + step*k] << 8) * weights[k] >> 16;
+    }
+    dst[i] = acc;
+  }
+}
+
+static inline void verticalFixedTail(const uint16_t* const* rows, unsigned char* out, size_t begin, size_t n,
+                                     const uint16_t* weights, int taps) {
+  uint16_t offset = fixedOffset(weights, taps) + 128;
+  for (size_t i = begin; i < n; ++i) {
+    uint16_t acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      acc += (uint32_t)rows[k][i] * weights[k] >> 16;
+    }
+    out[i] = acc >> 8;
+  }
+}
+
+static void horizontalFixedScalar(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights,
+                                  int step, int taps) {
+  horizontalFixedTail(src, dst, 0, n, weights, step, taps);
+}
+
+static void verticalFixedScalar(const uint16_t* const* rows, unsigned char* out, size_t n,
+                                const uint16_t* weights, int taps) {
+  verticalFixedTail(rows, out, 0, n, weights, taps);
+}
+
+static void deinterleaveScalar(const unsigned char* rgb, unsigned char* r, unsigned char* g, unsigned char* b,
+                               size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    r[i] = rgb[3*i];
+    g[i] = rgb[3*i + 1];
+    b[i] = rgb[3*i + 2];
+  }
+}
+
+static void interleaveScalar(const unsigned char* r, const unsigned char* g, const unsigned char* b,
+                             unsigned char* rgb, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    rgb[3*i] = r[i];
+    rgb[3*i + 1] = g[i];
+    rgb[3*i + 2] = b[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the AVX-512 headers of GCC 12 trigger false uninitialized warnings (fixed in GCC 12.3)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+
+// SSE4.1: 4 channels per instruction, u8 -> i32 -> f32
+__attribute__((target("sse4.1")))
+static void horizontalSse41(const unsigned char* src, float* dst, size_t n, const float* weights, int step, int taps) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 acc = _mm_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      int bytes;
+      memcpy(&bytes, src + i + step*k, 4);
+      __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+      acc = _mm_add_ps(acc, _mm_mul_ps(v, _mm_set1_ps(weights[k])));
+    }
+    _mm_storeu_ps(dst + i, acc);
+  }
+  horizontalTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("sse4.1")))
+static void verticalSse41(const float* const* rows, unsigned char* out, size_t n, const float* weights, int taps) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 acc = _mm_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), _mm_set1_ps(weights[k])));
+    }
+    // toChannel: +0.5, clamp to 0..255, truncate
+    acc = _mm_min_ps(_mm_max_ps(_mm_add_ps(acc, _mm_set1_ps(0.5f)), _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    __m128i c = _mm_cvttps_epi32(acc);
+    c = _mm_packus_epi16(_mm_packus_epi32(c, c), c);
+    int bytes = _mm_cvtsi128_si32(c);
+    memcpy(out + i, &bytes, 4);
+  }
+  verticalTail(rows, out, i, n, weights, taps);
+}
+
+// 8 channels per instruction
+__attribute__((target("sse4.1")))
+static void horizontalFixedSse41(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights,
+                                 int step, int taps) {
+  size_t i = 0;
+  const __m128i offset = _mm_set1_epi16(fixedOffset(weights, taps));
+  for (; i + 8 <= n; i += 8) {
+    __m128i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m128i v = _mm_slli_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(src + i + step*k))), 8);
+      acc = _mm_add_epi16(acc, _mm_mulhi_epu16(v, _mm_set1_epi16(weights[k])));
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), acc);
+  }
+  horizontalFixedTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("sse4.1")))
+static void verticalFixedSse41(const uint16_t* const* rows, unsigned char* out, size_t n,
+                               const uint16_t* weights, int taps) {
+  size_t i = 0;
+  const __m128i offset = _mm_set1_epi16(fixedOffset(weights, taps) + 128);
+  for (; i + 8 <= n; i += 8) {
+    __m128i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      acc = _mm_add_epi16(acc, _mm_mulhi_epu16(v, _mm_set1_epi16(weights[k])));
+    }
+    acc = _mm_srli_epi16(acc, 8);
+    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(acc, acc));
+  }
+  verticalFixedTail(rows, out, i, n, weights, taps);
+}
+
+/*
+16 pixels (48 bytes, three registers) per step with byte shuffles. Byte j of plane c is
+byte 3j+c of the pixels, from register (3j+c)/16; each register contributes its bytes to
+each plane through one shuffle, the other lanes of the shuffle are zero (-1 in the mask).
+The masks are the same for every call and built on the first one.
+*/
+struct ShuffleMasks {
+  __m128i split[3][3];   // [plane][register]
+  __m128i merge[3][3];   // [register][plane]
+};
+
+__attribute__((target("sse4.1")))
+static const ShuffleMasks* shuffleMasks() {
+  static const ShuffleMasks* masks = [] {
+    static ShuffleMasks m;
+    alignas(16) signed char bytes[16];
+    for (int c = 0; c < 3; ++c) {
+      for (int v = 0; v < 3; ++v) {
+        for (int j = 0; j < 16; ++j) {
+          int p = 3 * j + c;
+          bytes[j] = (p / 16 == v) ? p % 16 : -1;
+        }
+        m.split[c][v] = _mm_load_si128((const __m128i*)bytes);
+        for (int j = 0; j < 16; ++j) {
+          int p = 16 * v + j;
+          bytes[j] = (p % 3 == c) ? p / 3 : -1;
+        }
+        m.merge[v][c] = _mm_load_si128((const __m128i*)bytes);
+      }
+    }
+    return &m;
+  }();
+  return masks;
+}
+
+__attribute__((target("sse4.1")))
+static void deinterleaveSse41(const unsigned char* rgb, unsigned char* r, unsigned char* g, unsigned char* b,
+                              size_t n) {
+  const ShuffleMasks* m = shuffleMasks();
+  unsigned char* planes[3] = {r, g, b};
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v[3];
+    for (int k = 0; k < 3; ++k) {
+      v[k] = _mm_loadu_si128((const __m128i*)(rgb + 3*i + 16*k));
+    }
+    for (int c = 0; c < 3; ++c) {
+      __m128i plane = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], m->split[c][0]),
+                                                _mm_shuffle_epi8(v[1], m->split[c][1])),
+                                   _mm_shuffle_epi8(v[2], m->split[c][2]));
+      _mm_storeu_si128((__m128i*)(planes[c] + i), plane);
+    }
+  }
+  deinterleaveScalar(rgb + 3*i, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void interleaveSse41(const unsigned char* r, const unsigned char* g, const unsigned char* b,
+                            unsigned char* rgb, size_t n) {
+  const ShuffleMasks* m = shuffleMasks();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i planes[3] = {_mm_loadu_si128((const __m128i*)(r + i)), _mm_loadu_si128((const __m128i*)(g + i)),
+                         _mm_loadu_si128((const __m128i*)(b + i))};
+    for (int v = 0; v < 3; ++v) {
+      __m128i bytes = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(planes[0], m->merge[v][0]),
+                                                _mm_shuffle_epi8(planes[1], m->merge[v][1])),
+                                   _mm_shuffle_epi8(planes[2], m->merge[v][2]));
+      _mm_storeu_si128((__m128i*)(rgb + 3*i + 16*v), bytes);
+    }
+  }
+  interleaveScalar(r + i, g + i, b + i, rgb + 3*i, n - i);
+}
+
+// AVX2: 8 channels per instruction
+__attribute__((target("avx2")))
+static void horizontalAvx2(const unsigned char* src, float* dst, size_t n, const float* weights, int step, int taps) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      __m128i bytes = _mm_loadl_epi64((const __m128i*)(src + i + step*k));
+      __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(v, _mm256_set1_ps(weights[k])));
+    }
+    _mm256_storeu_ps(dst + i, acc);
+  }
+  horizontalTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("avx2")))
+static void verticalAvx2(const float* const* rows, unsigned char* out, size_t n, const float* weights, int taps) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + i), _mm256_set1_ps(weights[k])));
+    }
+    acc = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(acc, _mm256_set1_ps(0.5f)), _mm256_setzero_ps()),
+                        _mm256_set1_ps(255.0f));
+    __m256i c = _mm256_cvttps_epi32(acc);
+    __m128i c16 = _mm_packus_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(c16, c16));
+  }
+  verticalTail(rows, out, i, n, weights, taps);
+}
+
+// 16 channels per instruction
+__attribute__((target("avx2")))
+static void horizontalFixedAvx2(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights,
+                                int step, int taps) {
+  size_t i = 0;
+  const __m256i offset = _mm256_set1_epi16(fixedOffset(weights, taps));
+  for (; i + 16 <= n; i += 16) {
+    __m256i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i + step*k));
+      __m256i v = _mm256_slli_epi16(_mm256_cvtepu8_epi16(bytes), 8);
+      acc = _mm256_add_epi16(acc, _mm256_mulhi_epu16(v, _mm256_set1_epi16(weights[k])));
+    }
+    _mm256_storeu_si256((__m256i*)(dst + i), acc);
+  }
+  horizontalFixedTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("avx2")))
+static void verticalFixedAvx2(const uint16_t* const* rows, unsigned char* out, size_t n,
+                              const uint16_t* weights, int taps) {
+  size_t i = 0;
+  const __m256i offset = _mm256_set1_epi16(fixedOffset(weights, taps) + 128);
+  for (; i + 16 <= n; i += 16) {
+    __m256i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+      acc = _mm256_add_epi16(acc, _mm256_mulhi_epu16(v, _mm256_set1_epi16(weights[k])));
+    }
+    acc = _mm256_srli_epi16(acc, 8);
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+  }
+  verticalFixedTail(rows, out, i, n, weights, taps);
+}
+
+/*
+AVX-512: 16 channels per instruction. AVX-512F implies FMA, and the compiler would contract
+plain mul/add intrinsics into it. The explicitly rounded forms keep them separate, so the
+results stay those of the other paths.
+*/
+#define CUR (_MM_FROUND_CUR_DIRECTION)
+__attribute__((target("avx512f")))
+static void horizontalAvx512(const unsigned char* src, float* dst, size_t n, const float* weights, int step, int taps) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 acc = _mm512_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i + step*k));
+      __m512 v = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+      acc = _mm512_add_round_ps(acc, _mm512_mul_round_ps(v, _mm512_set1_ps(weights[k]), CUR), CUR);
+    }
+    _mm512_storeu_ps(dst + i, acc);
+  }
+  horizontalTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("avx512f")))
+static void verticalAvx512(const float* const* rows, unsigned char* out, size_t n, const float* weights, int taps) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 acc = _mm512_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      acc = _mm512_add_round_ps(acc, _mm512_mul_round_ps(_mm512_loadu_ps(rows[k] + i), _mm512_set1_ps(weights[k]), CUR),
+                                CUR);
+    }
+    acc = _mm512_min_ps(_mm512_max_ps(_mm512_add_ps(acc, _mm512_set1_ps(0.5f)), _mm512_setzero_ps()),
+                        _mm512_set1_ps(255.0f));
+    _mm_storeu_si128((__m128i*)(out + i), _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(acc)));
+  }
+  verticalTail(rows, out, i, n, weights, taps);
+}
+#undef CUR
+
+// AVX-512BW: 32 channels per instruction
+__attribute__((target("avx512bw")))
+static void horizontalFixedAvx512(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights,
+                                  int step, int taps) {
+  size_t i = 0;
+  const __m512i offset = _mm512_set1_epi16(fixedOffset(weights, taps));
+  for (; i + 32 <= n; i += 32) {
+    __m512i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)(src + i + step*k));
+      __m512i v = _mm512_slli_epi16(_mm512_cvtepu8_epi16(bytes), 8);
+      acc = _mm512_add_epi16(acc, _mm512_mulhi_epu16(v, _mm512_set1_epi16(weights[k])));
+    }
+    _mm512_storeu_si512((void*)(dst + i), acc);
+  }
+  horizontalFixedTail(src, dst, i, n, weights, step, taps);
+}
+
+__attribute__((target("avx512bw")))
+static void verticalFixedAvx512(const uint16_t* const* rows, unsigned char* out, size_t n,
+                                const uint16_t* weights, int taps) {
+  size_t i = 0;
+  const __m512i offset = _mm512_set1_epi16(fixedOffset(weights, taps) + 128);
+  for (; i + 32 <= n; i += 32) {
+    __m512i acc = offset;
+    for (int k = 0; k < taps; ++k) {
+      __m512i v = _mm512_loadu_si512((const void*)(rows[k] + i));
+      acc = _mm512_add_epi16(acc, _mm512_mulhi_epu16(v, _mm512_set1_epi16(weights[k])));
+    }
+    _mm256_storeu_si256((__m256i*)(out + i), _mm512_cvtepi16_epi8(_mm512_srli_epi16(acc, 8)));
+  }
+  verticalFixedTail(rows, out, i, n, weights, taps);
+}
+#pragma GCC diagnostic pop
+#endif
+
+// all kernels, best last
+static const RowKernels allKernels[] = {
+  {"scalar", horizontalScalar, verticalScalar, horizontalFixedScalar, verticalFixedScalar, deinterleaveScalar,
+   interleaveScalar},
+#ifdef HAVE_X86_KERNELS
+  // the conversions are bound by memory bandwidth, the 128-bit shuffles serve all x86 kernels
+  {"sse4.1", horizontalSse41, verticalSse41, horizontalFixedSse41, verticalFixedSse41, deinterleaveSse41,
+   interleaveSse41},
+  {"avx2", horizontalAvx2, verticalAvx2, horizontalFixedAvx2, verticalFixedAvx2, deinterleaveSse41,
+   interleaveSse41},
+  {"avx512", horizontalAvx512, verticalAvx512, horizontalFixedAvx512, verticalFixedAvx512, deinterleaveSse41,
+   interleaveSse41},
+#endif
+};
+static const int kernelCount = sizeof(allKernels) / sizeof(allKernels[0]);
+
+// whether the cpu (and the os, for the wider registers) supports a kernel, from CPUID
+bool kernelSupported(const RowKernels* kernels) {
+#ifdef HAVE_X86_KERNELS
+  if (strcmp(kernels->name, "sse4.1") == 0)
+    return __builtin_cpu_supports("sse4.1");
+  if (strcmp(kernels->name, "avx2") == 0)
+    return __builtin_cpu_supports("avx2");
+  if (strcmp(kernels->name, "avx512") == 0)
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+  return strcmp(kernels->name, "scalar") == 0;
+}
+
+// best kernels this cpu supports
+const RowKernels* detectKernels() {
+  for (int i = kernelCount - 1; i > 0; --i) {
+    if (kernelSupported(&allKernels[i]))
+      return &allKernels[i];
+  }
+  return &allKernels[0];
+}
+
+// kernels used by gaussFilter, can be set to compare or force one
+const RowKernels* rowKernels = detectKernels();
+
+// end row kernel section
+// ######################################################
+
+// size of the rolling row buffer of one tile, chosen to stay within a typical L2 cache
+#define TILE_BYTES (256 * 1024)
+// narrowest tile, so that the horizontal halo of radius pixels stays a small overhead
+#define MIN_TILE_WIDTH (64)
+
+/*
+Width of the column tiles: as wide as the image, or as wide as fits 2r+1 rows of
+channels samples per pixel into TILE_BYTES.
+*/
+int tileWidth(int width, int radius, size_t sampleSize, int channels) {
+  int w = TILE_BYTES / (int)(channels * sampleSize * (2 * radius + 1));
+  w = max(w, MIN_TILE_WIDTH);
+  return min(w, width);
+}
+
+// the float or fixed-point row kernels, chosen by the type of the intermediate samples
+static inline void horizontalRow(const unsigned char* src, float* dst, size_t n, const float* weights,
+                                 int step, int taps) {
+  rowKernels->horizontal(src, dst, n, weights, step, taps);
+}
+
+static inline void horizontalRow(const unsigned char* src, uint16_t* dst, size_t n, const uint16_t* weights,
+                                 int step, int taps) {
+  rowKernels->horizontalFixed(src, dst, n, weights, step, taps);
+}
+
+static inline void verticalRow(const float* const* rows, unsigned char* out, size_t n, const float* weights,
+                               int taps) {
+  rowKernels->vertical(rows, out, n, weights, taps);
+}
+
+static inline void verticalRow(const uint16_t* const* rows, unsigned char* out, size_t n,
+                               const uint16_t* weights, int taps) {
+  rowKernels->verticalFixed(rows, out, n, weights, taps);
+}
+
+/*
+Filters the output rectangle [x0, x1) x [y0, y1). Source rows y0-r .. y1+r-1 are filtered
+horizontally one after another into a ring of 2r+1 rows; as soon as the ring holds the rows
+y-r .. y+r, output row y is filtered vertically from it. Every source row is read once and the
+ring stays in cache. The pixel loops are the rowKernels of the cpu, float ones for float
+weights and fixed-point ones for Q16 weights. ring must hold (2r+1) * 3 * (x1-x0) samples,
+padded x1-x0+2r pixels and rows 2r+1 pointers.
+
+The border is handled outside the filter loops: a source row that reaches past the image is
+first copied into padded with the border pixels filled in according to mode, and rows above or
+below the image are resolved once per row. The loops over the pixels have no bounds checks.
+*/
+template <typename Sample, typename Weight>
+void gaussFilterTile(const Pixel* in, Pixel* out, int width, int height, const vector<Weight>& weights,
+                     BorderMode mode, int x0, int x1, int y0, int y1, Sample* ring, Pixel* padded,
+                     const Sample** rows) {
+  int radius = (int)weights.size() / 2;
+  int taps = 2 * radius + 1;
+  int w = x1 - x0;
+  size_t stride = 3 * (size_t)w;
+  const Pixel black = {0, 0, 0};
+  
+  for (int j = y0 - radius; j < y1 + radius; ++j) {
+    // horizontal pass of source row j into its ring slot
+    Sample* dst = ring + (size_t)((j - y0 + radius) % taps) * stride;
+    int sy = borderIndex(j, height, mode);
+    if (sy < 0) {
+      fill(dst, dst + stride, (Sample)0);
+    } else {
+      const Pixel* row = in + (size_t)sy * width;
+      const Pixel* src = row + x0 - radius;
+      if (x0 - radius < 0 || x1 + radius > width) {
+        for (int x = x0 - radius; x < x1 + radius; ++x) {
+          int sx = borderIndex(x, width, mode);
+          padded[x - x0 + radius] = (sx < 0) ? black : row[sx];
+        }
+        src = padded;
+      }
+      horizontalRow((const unsigned char*)src, dst, stride, weights.data(), 3, taps);
+    }
+    
+    // vertical pass of output row y once its last source row y+r is in the ring
+    int y = j - radius;
+    if (y < y0)
+      continue;
+    for (int k = 0; k < taps; ++k) {
+      rows[k] = ring + (size_t)((y - y0 + k) % taps) * stride;
+    }
+    verticalRow(rows, (unsigned char*)(out + (size_t)y * width + x0), stride, weights.data(), taps);
+  }
+}
+
+// alignment of the planes and of every row in them, one cache line and the widest vector
+#define PLANE_ALIGN (64)
+
+/*
+Image as three planes of one channel each (R, G, B). Each row has pad pixels on both sides,
+filled in according to the border mode (see toPlanar), so the horizontal pass reads straight
+from the plane without copying the row. The first pixel of every row is PLANE_ALIGN aligned.
+*/
+struct PlanarImage {
+  int width, height, pad;
+  size_t stride;              // bytes from one row to the next
+  unsigned char* data;
+  unsigned char* planes[3];   // pixel 0 of row 0 of each plane
+};
+
+void allocPlanar(PlanarImage* image, int width, int height, int pad) {
+  size_t left = (pad + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+  image->width = width;
+  image->height = height;
+  image->pad = pad;
+  image->stride = (left + width + pad + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+  size_t planeBytes = image->stride * height;
+  image->data = (unsigned char*)aligned_alloc(PLANE_ALIGN, 3 * planeBytes);
+  if (image->data == NULL)
+    exit(-1);
+  for (int c = 0; c < 3; ++c) {
+    image->planes[c] = image->data + c * planeBytes + left;
+  }
+}
+
+void freePlanar(PlanarImage* image) {
+  free(image->data);
+  image->data = NULL;
+}
+
+// splits an RGB image into the planes of image and fills in their padding
+void toPlanar(const Pixel* in, PlanarImage* image, BorderMode mode) {
+  int width = image->width, pad = image->pad;
+  for (int y = 0; y < image->height; ++y) {
+    unsigned char* rows[3];
+    for (int c = 0; c < 3; ++c) {
+      rows[c] = image->planes[c] + y * image->stride;
+    }
+    rowKernels->deinterleave((const unsigned char*)(in + (size_t)y * width), rows[0], rows[1], rows[2], width);
+    for (int c = 0; c < 3; ++c) {
+      for (int x = -pad; x < 0; ++x) {
+        int sx = borderIndex(x, width, mode);
+        rows[c][x] = (sx < 0) ? 0 : rows[c][sx];
+      }
+      for (int x = width; x < width + pad; ++x) {
+        int sx = borderIndex(x, width, mode);
+        rows[c][x] = (sx < 0) ? 0 : rows[c][sx];
+      }
+    }
+  }
+}
+
+// merges the planes of image into an RGB image
+void fromPlanar(const PlanarImage& image, Pixel* out) {
+  for (int y = 0; y < image.height; ++y) {
+    size_t offset = y * image.stride;
+    rowKernels->interleave(image.planes[0] + offset, image.planes[1] + offset, image.planes[2] + offset,
+                           (unsigned char*)(out + (size_t)y * image.width), image.width);
+  }
+}
+
+/*
+gaussFilterTile for one plane: the rectangle [x0, x1) x [y0, y1) of in (padded by at least
+r) into out, with a ring of (2r+1) * (x1-x0) samples and 2r+1 row pointers. The horizontal
+pass runs with step 1.
+*/
+template <typename Sample, typename Weight>
+void gaussFilterPlaneTile(const unsigned char* in, size_t inStride, unsigned char* out, size_t outStride,
+                          int height, const vector<Weight>& weights, BorderMode mode, int x0, int x1,
+                          int y0, int y1, Sample* ring, const Sample** rows) {
+  int radius = (int)weights.size() / 2;
+  int taps = 2 * radius + 1;
+  size_t w = x1 - x0;
+  
+  for (int j = y0 - radius; j < y1 + radius; ++j) {
+    Sample* dst = ring + (size_t)((j - y0 + radius) % taps) * w;
+    int sy = borderIndex(j, height, mode);
+    if (sy < 0)
+      fill(dst, dst + w, (Sample)0);
+    else
+      horizontalRow(in + sy * inStride + x0 - radius, dst, w, weights.data(), 1, taps);
+    
+    int y = j - radius;
+    if (y < y0)
+      continue;
+    for (int k = 0; k < taps; ++k) {
+      rows[k] = ring + (size_t)((y - y0 + k) % taps) * w;
+    }
+    verticalRow(rows, out + y * outStride + x0, w, weights.data(), taps);
+  }
+}
+
+// bands per thread, so that threads that finish early can take over work of slower ones
+#define BANDS_PER_THREAD (4)
+
+// threads used by gaussFilter, 0 for all threads of the pool (POOL_THREADS or the number of cpus)
+int filterThreads = 0;
+
+/*
+One filter call: tasks are column tiles of a horizontal band, numbered band by band, and
+for planar images plane by plane within a band. Either in and out or planarIn and planarOut
+are set.
+*/
+template <typename Sample, typename Weight>
+struct FilterJob {
+  const Pixel* in;
+  Pixel* out;
+  const PlanarImage* planarIn;
+  PlanarImage* planarOut;
+  int planes;
+  int width, height;
+  const vector<Weight>* weights;
+  BorderMode mode;
+  int tile, tiles, bandRows, tasks, threads;
+  atomic<int> next;
+};
+
+/*
+Ring, padded row and row pointers of one thread. They only grow, up to the largest filter call
+the thread has worked on, so repeated calls (the batch mode) do not allocate.
+*/
+template <typename Sample>
+struct FilterScratch {
+  vector<Sample> ring;
+  vector<Pixel> padded;
+  vector<const Sample*> rows;
+};
+
+template <typename Sample>
+static FilterScratch<Sample>* filterScratch(size_t ringSamples, size_t paddedPixels, size_t taps) {
+  static thread_local FilterScratch<Sample> scratch;
+  if (scratch.ring.size() < ringSamples)
+    scratch.ring.resize(ringSamples);
+  if (scratch.padded.size() < paddedPixels)
+    scratch.padded.resize(paddedPixels);
+  if (scratch.rows.size() < taps)
+    scratch.rows.resize(taps);
+  return &scratch;
+}
+
+// per thread: claims tasks until none are left, with its own ring and padded row
+template <typename Sample, typename Weight>
+static void filterTasks(void* arg, int self) {
+  FilterJob<Sample, Weight>* job = (FilterJob<Sample, Weight>*)arg;
+  if (self >= job->threads)
+    return;
+  int radius = (int)job->weights->size() / 2;
+  const PlanarImage* in = job->planarIn;
+  FilterScratch<Sample>* scratch = filterScratch<Sample>((size_t)(2 * radius + 1) * (in ? 1 : 3) * job->tile,
+                                                         in ? 0 : job->tile + 2 * radius, 2 * radius + 1);
+  Sample* ring = scratch->ring.data();
+  const Sample** rows = scratch->rows.data();
+  for (int t; (t = job->next.fetch_add(1, memory_order_relaxed)) < job->tasks; ) {
+    int x0 = (t % job->tiles) * job->tile, y0 = (t / (job->tiles * job->planes)) * job->bandRows;
+    int x1 = min(x0 + job->tile, job->width), y1 = min(y0 + job->bandRows, job->height);
+    if (in) {
+      int c = (t / job->tiles) % job->planes;
+      gaussFilterPlaneTile(in->planes[c], in->stride, job->planarOut->planes[c], job->planarOut->stride,
+                           job->height, *job->weights, job->mode, x0, x1, y0, y1, ring, rows);
+    } else {
+      gaussFilterTile(job->in, job->out, job->width, job->height, *job->weights, job->mode,
+                      x0, x1, y0, y1, ring, scratch->padded.data(), rows);
+    }
+  }
+}
+
+// cuts the tiles of job into bands and runs its tasks on filterThreads threads of the pool
+template <typename Sample, typename Weight>
+static void runFilterJob(FilterJob<Sample, Weight>* job) {
+  int radius = (int)job->weights->size() / 2;
+  job->threads = (filterThreads > 0) ? min(filterThreads, pool_threads()) : pool_threads();
+  job->tiles = (job->width + job->tile - 1) / job->tile;
+  job->bandRows = job->height;
+  if (job->threads > 1) {
+    int columns = job->tiles * job->planes;
+    int bands = (BANDS_PER_THREAD * job->threads + columns - 1) / columns;
+    job->bandRows = max((job->height + bands - 1) / bands, max(4 * radius, 1));
+  }
+  job->tasks = job->tiles * job->planes * ((job->height + job->bandRows - 1) / job->bandRows);
+  job->next = 0;
+  if (job->threads == 1 || job->tasks == 1)
+    filterTasks<Sample, Weight>(job, 0);
+  else
+    run_on_threads(filterTasks<Sample, Weight>, job);
+}
+
+/*
+Separable gaussian, out must not overlap with in. 2*(2r+1) weights per pixel instead of
+(2r+1)^2. The intermediate values are not rounded, so the result matches gaussFilter2D up
+to float rounding (at most 1 in a channel).
+The image is processed in column tiles of tileWidth() pixels, each from top to bottom
+with a rolling row buffer (see gaussFilterTile), so the working set is independent of the
+image height and stays in cache even for 8K images.
+With several threads the tiles are also cut into horizontal bands. Every band filters its
+r halo rows above and below once more, so bands are kept at least 4r rows high.
+*/
+template <typename Sample, typename Weight>
+void separableFilter(const Pixel* in, Pixel* out, int width, int height, const vector<Weight>& weights,
+                     BorderMode mode) {
+  FilterJob<Sample, Weight> job;
+  int radius = (int)weights.size() / 2;
+  if (width <= 0 || height <= 0)
+    return;
+  job.in = in;
+  job.out = out;
+  job.planarIn = NULL;
+  job.planarOut = NULL;
+  job.planes = 1;
+  job.width = width;
+  job.height = height;
+  job.weights = &weights;
+  job.mode = mode;
+  job.tile = tileWidth(width, radius, sizeof(Sample), 3);
+  runFilterJob(&job);
+}
+
+void gaussFilter(const Pixel* in, Pixel* out, int width, int height, const vector<float>& weights,
+                 BorderMode mode) {
+  separableFilter<float>(in, out, width, height, weights, mode);
+}
+
+/*
+The same with 8-bit fixed-point arithmetic and weights from quantizeWeights(), which must pass
+fixedWeightsFit(). Differs from gaussFilter by at most 1 in a channel.
+*/
+void gaussFilterFixed(const Pixel* in, Pixel* out, int width, int height, const vector<uint16_t>& weights,
+                      BorderMode mode) {
+  separableFilter<uint16_t>(in, out, width, height, weights, mode);
+}
+
+/*
+The separable filter on planes, in must be padded by at least r. The same engine as
+separableFilter with each plane tiled on its own; a plane tile is three times as wide, since
+its samples hold one channel. Gives exactly the same result as the interleaved filter.
+*/
+template <typename Sample, typename Weight>
+void planarFilter(const PlanarImage& in, PlanarImage* out, const vector<Weight>& weights, BorderMode mode) {
+  FilterJob<Sample, Weight> job;
+  int radius = (int)weights.size() / 2;
+  if (in.width <= 0 || in.height <= 0)
+    return;
+  job.in = NULL;
+  job.out = NULL;
+  job.planarIn = &in;
+  job.planarOut = out;
+  job.planes = 3;
+  job.width = in.width;
+  job.height = in.height;
+  job.weights = &weights;
+  job.mode = mode;
+  job.tile = tileWidth(in.width, radius, sizeof(Sample), 1);
+  runFilterJob(&job);
+}
+
+/*
+gaussFilter or gaussFilterFixed (weights from quantizeWeights) through the planar layout,
+including the conversions at both ends.
+*/
+void gaussFilterPlanar(const Pixel* in, Pixel* out, int width, int height, const vector<float>& weights,
+                       BorderMode mode, bool fixedPoint) {
+  PlanarImage planes, result;
+  int radius = (int)weights.size() / 2;
+  allocPlanar(&planes, width, height, radius);
+  allocPlanar(&result, width, height, 0);
+  toPlanar(in, &planes, mode);
+  if (fixedPoint)
+    planarFilter<uint16_t>(planes, &result, quantizeWeights(weights), mode);
+  else
+    planarFilter<float>(planes, &result, weights, mode);
+  fromPlanar(result, out);
+  freePlanar(&planes);
+  freePlanar(&result);
+}
+
+// ######################################################
+// Start streaming section
+
+// bytes of input read ahead per chunk, and chunks in flight between reader and filter
+#define STREAM_CHUNK_BYTES (1 << 20)
+#define STREAM_CHUNKS (4)
+
+/*
+Reads the rows of the pixel data on its own thread, STREAM_CHUNKS chunks of chunkRows rows
+ahead of the filter, so that reading from the disk overlaps with filtering.
+Chunk c goes to slot c % STREAM_CHUNKS once the filter has released chunk c - STREAM_CHUNKS.
+*/
+struct RowReader {
+  FILE* file;
+  int width, height, chunkRows, chunks;
+  vector<Pixel> buffer;
+  int read, released;   // chunks read by the thread, chunks released by the filter
+  bool failed, stop;
+  mutex lock;
+  condition_variable changed;
+  thread worker;
+};
+
+static void readRows(RowReader* reader) {
+  for (int c = 0; c < reader->chunks; ++c) {
+    {
+      unique_lock<mutex> guard(reader->lock);
+      reader->changed.wait(guard, [&] { return reader->stop || c - reader->released < STREAM_CHUNKS; });
+      if (reader->stop)
+        return;
+    }
+    int rows = min(reader->chunkRows, reader->height - c * reader->chunkRows);
+    Pixel* slot = reader->buffer.data() + (size_t)(c % STREAM_CHUNKS) * reader->chunkRows * reader->width;
+    bool ok = fread(slot, sizeof(Pixel) * reader->width, rows, reader->file) == (size_t)rows;
+    lock_guard<mutex> guard(reader->lock);
+    if (ok)
+      reader->read = c + 1;
+    else
+      reader->failed = true;
+    reader->changed.notify_all();
+    if (!ok)
+      return;
+  }
+}
+
+void startReader(RowReader* reader, FILE* file, int width, int height) {
+  reader->file = file;
+  reader->width = width;
+  reader->height = height;
+  int rows = (height + STREAM_CHUNKS - 1) / STREAM_CHUNKS;
+  reader->chunkRows = max(1, min(rows, STREAM_CHUNK_BYTES / (int)(sizeof(Pixel) * width)));
+  reader->chunks = (height + reader->chunkRows - 1) / reader->chunkRows;
+  reader->buffer.resize((size_t)STREAM_CHUNKS * reader->chunkRows * width);
+  reader->read = reader->released = 0;
+  reader->failed = reader->stop = false;
+  reader->worker = thread(readRows, reader);
+}
+
+// waits for chunk c, NULL if the file ended before it
+const Pixel* readerChunk(RowReader* reader, int c) {
+  unique_lock<mutex> guard(reader->lock);
+  reader->changed.wait(guard, [&] { return reader->read > c || reader->failed; });
+  if (reader->read <= c)
+    return NULL;
+  return reader->buffer.data() + (size_t)(c % STREAM_CHUNKS) * reader->chunkRows * reader->width;
+}
+
+// the filter is done with chunks 0..c, their slots can be refilled
+void releaseChunk(RowReader* reader, int c) {
+  lock_guard<mutex> guard(reader->lock);
+  reader->released = c + 1;
+  reader->changed.notify_all();
+}
+
+void stopReader(RowReader* reader) {
+  {
+    lock_guard<mutex> guard(reader->lock);
+    reader->stop = true;
+    reader->changed.notify_all();
+  }
+  reader->worker.join();
+}
+
+// copies a row into padded (width + 2r pixels) with the border pixels filled in
+static void padRow(const Pixel* row, Pixel* padded, int width, int radius, BorderMode mode) {
+  const Pixel black = {0, 0, 0};
+  memcpy(padded + radius, row, sizeof(Pixel) * width);
+  for (int x = -radius; x < 0; ++x) {
+    int sx = borderIndex(x, width, mode);
+    padded[x + radius] = (sx < 0) ? black : row[sx];
+  }
+  for (int x = width; x < width + radius; ++x) {
+    int sx = borderIndex(x, width, mode);
+    padded[x + radius] = (sx < 0) ? black : row[sx];
+  }
+}
+
+/*
+Filters a PPM payload from in to out row by row without ever holding the image: pixel rows
+come in chunks from a RowReader thread, the last r+1 of them are kept padded, their horizontal
+results go into a ring of 2r+1 rows, and every finished output row is written right away.
+Memory is O(width * r) plus the read-ahead chunks, independent of the height.
+Rows above and below the image are filtered once their source rows are in the window: the top
+ones after row r has been read. With BORDER_WRAP they come from the other end of the image, so
+the first r rows are kept and the last r rows are read before everything else; that needs a
+seekable input.
+Gives the same result as separableFilter.
+*/
+template <typename Sample, typename Weight>
+bool streamFilter(FILE* in, FILE* out, int width, int height, const vector<Weight>& weights,
+                  BorderMode mode, size_t* bufferBytes) {
+  int radius = (int)weights.size() / 2;
+  int taps = 2 * radius + 1;
+  int windowRows = min(radius + 1, height);
+  size_t padWidth = (size_t)width + 2 * radius;
+  size_t stride = 3 * (size_t)width;
+  size_t rowBytes = sizeof(Pixel) * width;
+  bool wrapEnds = (mode == BORDER_WRAP && height > windowRows);
+  vector<Pixel> window(windowRows * padWidth);
+  vector<Pixel> head(wrapEnds ? radius * padWidth : 0), tail(head.size());
+  vector<Sample> ring(taps * stride);
+  vector<const Sample*> rows(taps);
+  vector<Pixel> outRow(width);
+  
+  if (wrapEnds) {
+    off_t start = ftello(in);
+    if (start < 0 || fseeko(in, start + (off_t)(height - radius) * rowBytes, SEEK_SET) != 0) {
+      cerr << "border mode wrap needs a seekable input" << endl;
+      return false;
+    }
+    for (int i = 0; i < radius; ++i) {
+      if (fread(outRow.data(), rowBytes, 1, in) != 1) {
+        cerr << "unexpected end of file" << endl;
+        return false;
+      }
+      padRow(outRow.data(), tail.data() + i * padWidth, width, radius, mode);
+    }
+    fseeko(in, start, SEEK_SET);
+  }
+  
+  // padded source row sy: the window holds rows last-windowRows+1..last
+  int last = -1;
+  auto source = [&](int sy) -> const Pixel* {
+    if (sy > last - windowRows && sy <= last)
+      return window.data() + (sy % windowRows) * padWidth;
+    return (sy < radius) ? head.data() + sy * padWidth : tail.data() + (sy - (height - radius)) * padWidth;
+  };
+  // horizontal pass of source row j (-r..height+r-1) into its ring slot
+  auto horizontal = [&](int j) {
+    Sample* dst = ring.data() + (size_t)((j + radius) % taps) * stride;
+    int sy = borderIndex(j, height, mode);
+    if (sy < 0)
+      fill(dst, dst + stride, (Sample)0);
+    else
+      horizontalRow((const unsigned char*)source(sy), dst, stride, weights.data(), 3, taps);
+  };
+  
+  RowReader reader;
+  startReader(&reader, in, width, height);
+  fprintf(out, "P6\n%d %d\n255\n", width, height);
+  const Pixel* chunk = NULL;
+  bool ok = true;
+  for (int j = 0; ok && j < height + radius; ++j) {
+    if (j < height) {
+      int c = j / reader.chunkRows;
+      if (j % reader.chunkRows == 0) {
+        if (c > 0)
+          releaseChunk(&reader, c - 1);
+        chunk = readerChunk(&reader, c);
+        if (chunk == NULL) {
+          cerr << "unexpected end of file" << endl;
+          ok = false;
+          break;
+        }
+      }
+      last = j;
+      Pixel* padded = window.data() + (j % windowRows) * padWidth;
+      padRow(chunk + (size_t)(j % reader.chunkRows) * width, padded, width, radius, mode);
+      if (wrapEnds && j < radius)
+        copy(padded, padded + padWidth, head.begin() + j * padWidth);
+    }
+    horizontal(j);
+    if (j == min(radius, height - 1)) {
+      for (int v = -radius; v < 0; ++v)
+        horizontal(v);
+    }
+    
+    // vertical pass of output row y once its last source row y+r is in the ring
+    int y = j - radius;
+    if (y < 0)
+      continue;
+    for (int k = 0; k < taps; ++k) {
+      rows[k] = ring.data() + (size_t)((y + k) % taps) * stride;
+    }
+    verticalRow(rows.data(), (unsigned char*)outRow.data(), stride, weights.data(), taps);
+    ok = fwrite(outRow.data(), rowBytes, 1, out) == 1;
+  }
+  stopReader(&reader);
+  
+  *bufferBytes = sizeof(Pixel) * (window.size() + head.size() + tail.size() + outRow.size() + reader.buffer.size())
+               + sizeof(Sample) * ring.size();
+  if (fflush(out) != 0 || ferror(out)) {
+    cerr << "could not write the output" << endl;
+    ok = false;
+  }
+  return ok;
+}
+
+/*
+Streams a PPM file through the float or fixed-point filter, "-" for stdin or stdout.
+Prints the time and the memory of the row buffers to stderr.
+*/
+bool gaussFilterStream(const char* inFilename, const char* outFilename, const vector<float>& weights,
+                       BorderMode mode, bool fixedPoint) {
+  FILE* in = (strcmp(inFilename, "-") == 0) ? stdin : fopen(inFilename, "rb");
+  if (in == NULL) {
+    cerr << "could not open " << inFilename << endl;
+    return false;
+  }
+  int width, height;
+  if (!readPPMHeader(in, &width, &height)) {
+    cerr << inFilename << " is not a binary PPM with maxval 255" << endl;
+    fclose(in);
+    return false;
+  }
+  // opening the input for writing would truncate it before it has been read
+  struct stat inInfo, outInfo;
+  if (fstat(fileno(in), &inInfo) == 0 && strcmp(outFilename, "-") != 0 && stat(outFilename, &outInfo) == 0 &&
+      inInfo.st_dev == outInfo.st_dev && inInfo.st_ino == outInfo.st_ino) {
+    cerr << "cannot stream " << inFilename << " onto itself" << endl;
+    fclose(in);
+    return false;
+  }
+  FILE* out = (strcmp(outFilename, "-") == 0) ? stdout : fopen(outFilename, "wb");
+  if (out == NULL) {
+    cerr << "could not open " << outFilename << endl;
+    fclose(in);
+    return false;
+  }
+  
+  size_t bufferBytes = 0;
+  auto start = chrono::steady_clock::now();
+  bool ok = fixedPoint
+          ? streamFilter<uint16_t>(in, out, width, height, quantizeWeights(weights), mode, &bufferBytes)
+          : streamFilter<float>(in, out, width, height, weights, mode, &bufferBytes);
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (ok) {
+    cerr << width << "x" << height << " streamed in " << seconds << " s ("
+         << (double)width * height / seconds / 1e6 << " MPixel/s), " << bufferBytes / 1024
+         << " KiB of row buffers for a " << (size_t)3 * width * height / 1024 << " KiB image" << endl;
+  }
+  fclose(in);
+  fclose(out);
+  return ok;
+}
+
+// end streaming section
+// ######################################################
+
+// largest difference of any channel of two images
+int maxDifference(const Pixel* a, const Pixel* b, int width, int height) {
+  const unsigned char* ca = (const unsigned char*)a;
+  const unsigned char* cb = (const unsigned char*)b;
+  int diff = 0;
+  for (size_t i = 0; i < 3 * (size_t)width * height; ++i) {
+    diff = max(diff, abs(ca[i] - cb[i]));
+  }
+  return diff;
+}
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// streams image through temporary files and compares the result with expected
+template <typename Sample, typename Weight>
+bool streamMatches(const vector<Pixel>& image, const vector<Pixel>& expected, int width, int height,
+                   const vector<Weight>& weights, BorderMode mode) {
+  FILE* in = tmpfile();
+  FILE* out = tmpfile();
+  vector<Pixel> result(image.size());
+  size_t bufferBytes;
+  int w, h;
+  fprintf(in, "P6\n%d %d\n255\n", width, height);
+  fwrite(image.data(), sizeof(Pixel), image.size(), in);
+  rewind(in);
+  bool ok = readPPMHeader(in, &w, &h) && streamFilter<Sample>(in, out, w, h, weights, mode, &bufferBytes);
+  rewind(out);
+  ok = ok && readPPMHeader(out, &w, &h) && fread(result.data(), sizeof(Pixel), result.size(), out) == result.size();
+  fclose(in);
+  fclose(out);
+  return ok && memcmp(result.data(), expected.data(), sizeof(Pixel) * result.size()) == 0;
+}
+
+/*
+Runs every row kernel this cpu supports on random images of awkward sizes, for several radii
+and all border modes, and compares the results with the scalar kernels. On the small images
+the scalar result must not differ from gaussFilter2D by more than 1. The kernels must not differ
+by more than 1; they are identical unless the build lets the compiler contract the scalar loops
+into FMA (e.g. -march=native). The streaming filter must give exactly the same as the scalar one,
+and so must the planar filter with the same kernels. The fixed-point kernels must be identical to the scalar
+fixed-point ones, which in turn must not differ from the scalar float ones by more than 1, also
+for radii far beyond the nonzero weights and for white images, where the sums are largest.
+Then times each kernel on a 1920x1080 image, the planar filter including the conversions.
+*/
+int testKernels() {
+  static const int sizes[][2] = {{1, 1}, {7, 5}, {33, 17}, {257, 3}, {640, 480}};
+  static const int radii[] = {0, 1, 3, 9, 15};
+  const RowKernels* detected = rowKernels;
+  int errors = 0, inexact = 0, fixedInexact = 0, referenceInexact = 0;
+  srand(1);
+  for (const auto& size : sizes) {
+    int width = size[0], height = size[1];
+    vector<Pixel> image((size_t)width * height), expected(image.size()), result(image.size());
+    vector<Pixel> expectedFixed(image.size());
+    for (Pixel& p : image) {
+      p.r = rand() & 255; p.g = rand() & 255; p.b = rand() & 255;
+    }
+    for (int radius : radii) {
+      vector<float> weights = calculateWeights(max(radius, 1) / 3.0f, radius);
+      vector<uint16_t> fixedWeights = quantizeWeights(weights);
+      for (int mode = BORDER_CLAMP; mode <= BORDER_ZERO; ++mode) {
+        rowKernels = &allKernels[0];
+        gaussFilter(image.data(), expected.data(), width, height, weights, (BorderMode)mode);
+        gaussFilterFixed(image.data(), expectedFixed.data(), width, height, fixedWeights, (BorderMode)mode);
+        int diff = maxDifference(expectedFixed.data(), expected.data(), width, height);
+        if (diff > 1) {
+          cout << "fixed point differs from float: " << width << "x" << height << ", radius " << radius
+               << ", border mode " << mode << ", max difference " << diff << endl;
+          ++errors;
+        }
+        fixedInexact += (diff > 0);
+        // the 2D reference, only on small images since it is slow
+        if (width * height <= 1000) {
+          gaussFilter2D(image.data(), result.data(), width, height, weights, (BorderMode)mode);
+          diff = maxDifference(expected.data(), result.data(), width, height);
+          if (diff > 1) {
+            cout << "separable differs from 2D: " << width << "x" << height << ", radius " << radius
+                 << ", border mode " << mode << ", max difference " << diff << endl;
+            ++errors;
+          }
+          referenceInexact += (diff > 0);
+        }
+        if (!streamMatches<float>(image, expected, width, height, weights, (BorderMode)mode) ||
+            !streamMatches<uint16_t>(image, expectedFixed, width, height, fixedWeights, (BorderMode)mode)) {
+          cout << "streaming differs: " << width << "x" << height << ", radius " << radius
+               << ", border mode " << mode << endl;
+          ++errors;
+        }
+        gaussFilterPlanar(image.data(), result.data(), width, height, weights, (BorderMode)mode, false);
+        bool planarOk = memcmp(result.data(), expected.data(), sizeof(Pixel) * image.size()) == 0;
+        gaussFilterPlanar(image.data(), result.data(), width, height, weights, (BorderMode)mode, true);
+        if (!planarOk || memcmp(result.data(), expectedFixed.data(), sizeof(Pixel) * image.size()) != 0) {
+          cout << "planar differs: " << width << "x" << height << ", radius " << radius
+               << ", border mode " << mode << endl;
+          ++errors;
+        }
+        for (int i = 1; i < kernelCount; ++i) {
+          if (!kernelSupported(&allKernels[i]))
+            continue;
+          rowKernels = &allKernels[i];
+          gaussFilter(image.data(), result.data(), width, height, weights, (BorderMode)mode);
+          int diff = maxDifference(result.data(), expected.data(), width, height);
+          if (diff > 1) {
+            cout << allKernels[i].name << " differs from scalar: " << width << "x" << height
+                 << ", radius " << radius << ", border mode " << mode << ", max difference "
+                 << diff << endl;
+            ++errors;
+          }
+          inexact += (diff > 0);
+          gaussFilterPlanar(image.data(), result.data(), width, height, weights, (BorderMode)mode, false);
+          diff = maxDifference(result.data(), expected.data(), width, height);
+          if (diff > 1) {
+            cout << allKernels[i].name << " planar differs from scalar: " << width << "x" << height
+                 << ", radius " << radius << ", border mode " << mode << ", max difference "
+                 << diff << endl;
+            ++errors;
+          }
+          inexact += (diff > 0);
+          gaussFilterFixed(image.data(), result.data(), width, height, fixedWeights, (BorderMode)mode);
+          bool fixedOk = memcmp(result.data(), expectedFixed.data(), sizeof(Pixel) * image.size()) == 0;
+          gaussFilterPlanar(image.data(), result.data(), width, height, weights, (BorderMode)mode, true);
+          if (!fixedOk || memcmp(result.data(), expectedFixed.data(), sizeof(Pixel) * image.size()) != 0) {
+            cout << allKernels[i].name << " fixed point differs from scalar: " << width << "x" << height
+                 << ", radius " << radius << ", border mode " << mode << endl;
+            ++errors;
+          }
+        }
+      }
+    }
+  }
+  
+  // {sigma, radius}: the radius is trimmed to the nonzero weights, the last one is too wide for fixed point
+  static const float wide[][2] = {{2.0f, 100.0f}, {1.0f, 200.0f}, {14.0f, 100.0f}, {33.0f, 100.0f}};
+  for (const auto& kernel : wide) {
+    int width = 64, height = 64;
+    vector<float> weights = calculateWeights(kernel[0], (int)kernel[1]);
+    vector<uint16_t> fixedWeights = quantizeWeights(weights);
+    if (!fixedWeightsFit(fixedWeights)) {
+      if (kernel[0] < 33.0f) {
+        cout << "fixed point refused: sigma " << kernel[0] << ", radius " << kernel[1] << endl;
+        ++errors;
+      }
+      continue;
+    }
+    vector<Pixel> image((size_t)width * height), expected(image.size()), result(image.size());
+    for (int white = 0; white < 2; ++white) {
+      for (Pixel& p : image) {
+        p.r = white ? 255 : rand() & 255; p.g = white ? 255 : rand() & 255; p.b = white ? 255 : rand() & 255;
+      }
+      for (int mode = BORDER_CLAMP; mode <= BORDER_ZERO; ++mode) {
+        rowKernels = &allKernels[0];
+        gaussFilter(image.data(), expected.data(), width, height, weights, (BorderMode)mode);
+        for (int i = 0; i < kernelCount; ++i) {
+          if (!kernelSupported(&allKernels[i]))
+            continue;
+          rowKernels = &allKernels[i];
+          gaussFilterFixed(image.data(), result.data(), width, height, fixedWeights, (BorderMode)mode);
+          int diff = maxDifference(result.data(), expected.data(), width, height);
+          if (diff > 1) {
+            cout << allKernels[i].name << " fixed point differs from float: " << (white ? "white " : "")
+                 << width << "x" << height << ", sigma " << kernel[0] << ", radius " << kernel[1]
+                 << ", border mode " << mode << ", max difference " << diff << endl;
+            ++errors;
+          }
+          fixedInexact += (diff > 0);
+        }
+      }
+    }
+  }
+  rowKernels = detected;
+  
+  int width = 1920, height = 1080;
+  vector<Pixel> image((size_t)width * height), result(image.size());
+  vector<float> weights = calculateWeights(5.0f, 15);
+  vector<uint16_t> fixedWeights = quantizeWeights(weights);
+  for (Pixel& p : image) {
+    p.r = rand() & 255; p.g = rand() & 255; p.b = rand() & 255;
+  }
+  for (int i = 0; i < kernelCount; ++i) {
+    if (!kernelSupported(&allKernels[i])) {
+      cout << allKernels[i].name << ": not supported" << endl;
+      continue;
+    }
+    rowKernels = &allKernels[i];
+    auto start = chrono::steady_clock::now();
+    gaussFilter(image.data(), result.data(), width, height, weights, BORDER_CLAMP);
+    double floatTime = secondsSince(start);
+    start = chrono::steady_clock::now();
+    gaussFilterFixed(image.data(), result.data(), width, height, fixedWeights, BORDER_CLAMP);
+    double fixedTime = secondsSince(start);
+    start = chrono::steady_clock::now();
+    gaussFilterPlanar(image.data(), result.data(), width, height, weights, BORDER_CLAMP, false);
+    double planarTime = secondsSince(start);
+    start = chrono::steady_clock::now();
+    gaussFilterPlanar(image.data(), result.data(), width, height, weights, BORDER_CLAMP, true);
+    double planarFixedTime = secondsSince(start);
+    cout << allKernels[i].name << ": " << floatTime << " s float, " << fixedTime << " s fixed point; planar "
+         << planarTime << " s float, " << planarFixedTime << " s fixed point for " << width << "x" << height
+         << ", radius 15" << ((&allKernels[i] == detected) ? " (default)" : "") << endl;
+  }
+  rowKernels = detected;
+  
+  if (inexact > 0)
+    cout << inexact << " results differ from scalar by 1." << endl;
+  if (fixedInexact > 0)
+    cout << fixedInexact << " fixed-point results differ from float by 1." << endl;
+  if (referenceInexact > 0)
+    cout << referenceInexact << " separable results differ from 2D by 1." << endl;
+  if (errors > 0)
+    cout << errors << " errors occured." << endl;
+  else
+    cout << "no errors occured." << endl;
+  return errors > 0;
+}
+
+/*
+Time of the filter on one image for 1, 2, 4, ... threads up to the size of the pool.
+The image should be large (4K or 8K) so that the bands keep every thread busy.
+*/
+void threadSweep(const Pixel* image, Pixel* output, int width, int height, const vector<float>& weights,
+                 BorderMode mode, bool fixedPoint) {
+  vector<uint16_t> fixedWeights = quantizeWeights(weights);
+  int saved = filterThreads;
+  double single = 0.0;
+  cout << width << "x" << height << ", radius " << weights.size() / 2 << ", " << rowKernels->name
+       << (fixedPoint ? " fixed point" : " float") << endl;
+  cout << setw(8) << "threads" << setw(12) << "s" << setw(12) << "MPixel/s" << setw(10) << "speedup" << endl;
+  for (int threads = 1; ; threads = min(2 * threads, pool_threads())) {
+    filterThreads = threads;
+    double best = 1e30;
+    // best of three, the first run also warms up the pool and the caches
+    for (int run = 0; run < 3; ++run) {
+      auto start = chrono::steady_clock::now();
+      if (fixedPoint)
+        gaussFilterFixed(image, output, width, height, fixedWeights, mode);
+      else
+        gaussFilter(image, output, width, height, weights, mode);
+      best = min(best, secondsSince(start));
+    }
+    if (threads == 1)
+      single = best;
+    cout << setw(8) << threads << setw(12) << best << setw(12) << (double)width * height / best / 1e6
+         << setw(10) << single / best << endl;
+    if (threads == pool_threads())
+      break;
+  }
+  filterThreads = saved;
+}
+
+/*
+Load and save time of the input image with readPPM/writePPM (ifstream, copies through the
+stream buffers into a malloc'd image) and with mapPPM/createPPM (the payload is copied once
+from one mapping to the other, as the filter would read and write it). Best of three each,
+the first run also brings the file into the page cache.
+*/
+bool benchmarkIO(const char* inFilename, const char* outFilename) {
+  MappedImage input, output;
+  if (!mapPPM(inFilename, &input))
+    return false;
+  int width = input.width, height = input.height, channels = input.channels;
+  size_t bytes = (size_t)channels * width * height;
+  unmapPPM(&input);
+  
+  double streamTime = 1e30, mapTime = 1e30;
+  for (int run = 0; run < 3; ++run) {
+    if (channels == 3) {
+      auto start = chrono::steady_clock::now();
+      Pixel* image = readPPM(inFilename, &width, &height);
+      writePPM(image, outFilename, width, height);
+      free(image);
+      streamTime = min(streamTime, secondsSince(start));
+    }
+    
+    auto start = chrono::steady_clock::now();
+    if (!mapPPM(inFilename, &input) || !createPPM(outFilename, width, height, channels, &output, &input))
+      return false;
+    memcpy(output.pixels, input.pixels, bytes);
+    unmapPPM(&input);
+    if (!unmapPPM(&output))
+      return false;
+    mapTime = min(mapTime, secondsSince(start));
+  }
+  
+  cout << width << "x" << height << (channels == 3 ? " P6, " : " P5, ") << bytes / (1 << 20) << " MiB" << endl;
+  if (channels == 3)
+    cout << "ifstream load+save: " << streamTime << " s (" << 2 * bytes / streamTime / 1e9 << " GB/s)" << endl;
+  cout << "mmap load+save:     " << mapTime << " s (" << 2 * bytes / mapTime / 1e9 << " GB/s)" << endl;
+  return true;
+}
+
+// ######################################################
+// Start batch section
+
+// blocking queue of at most capacity items, pop fails once the queue is closed and empty
+template <typename T>
+struct BoundedQueue {
+  vector<T> items;
+  size_t head = 0, count = 0;
+  bool closed = false;
+  mutex lock;
+  condition_variable notEmpty, notFull;
+  
+  explicit BoundedQueue(size_t capacity) : items(capacity) {}
+  
+  void push(T item) {
+    unique_lock<mutex> guard(lock);
+    notFull.wait(guard, [&] { return count < items.size(); });
+    items[(head + count++) % items.size()] = item;
+    notEmpty.notify_one();
+  }
+  
+  bool pop(T* item) {
+    unique_lock<mutex> guard(lock);
+    notEmpty.wait(guard, [&] { return count > 0 || closed; });
+    if (count == 0)
+      return false;
+    *item = items[head];
+    head = (head + 1) % items.size();
+    --count;
+    notFull.notify_one();
+    return true;
+  }
+  
+  void close() {
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    notEmpty.notify_all();
+  }
+};
+
+// one image on its way through the batch pipeline, the buffers are reused for the next one
+struct Frame {
+  size_t file;
+  int width, height, channels;
+  bool ok;
+  vector<Pixel> image, output;
+};
+
+/*
+Read -> filter -> write pipeline over many files. Frames circulate from the spare queue through
+the readers, filters and writers back to the spare queue, so the stages work on different
+images at the same time and the pixel buffers are allocated only until they have grown to the
+largest image. The last worker of a stage closes the queue of the next stage.
+*/
+struct Batch {
+  vector<string> inputs;
+  string outDir;
+  const vector<float>* weights;
+  vector<uint16_t> fixedWeights;
+  BorderMode mode;
+  bool fixedPoint;
+  atomic<size_t> nextFile;
+  atomic<int> failed;
+  BoundedQueue<Frame*> spare, read, filtered;
+  atomic<int> running[3];
+  double busy[3];   // seconds spent working (not waiting) by all workers of a stage
+  mutex busyLock;
+  
+  explicit Batch(size_t frames) : spare(frames), read(frames), filtered(frames) {}
+};
+
+enum BatchStage { STAGE_READ, STAGE_FILTER, STAGE_WRITE };
+
+static void addBusy(Batch* batch, BatchStage stage, double seconds) {
+  lock_guard<mutex> guard(batch->busyLock);
+  batch->busy[stage] += seconds;
+}
+
+// last worker of a stage closes the queue the stage feeds
+static void finishStage(Batch* batch, BatchStage stage, BoundedQueue<Frame*>* next) {
+  if (batch->running[stage].fetch_sub(1) == 1 && next != NULL)
+    next->close();
+}
+
+static void readFrames(Batch* batch) {
+  double busy = 0.0;
+  Frame* frame = NULL;
+  for (size_t file; (file = batch->nextFile.fetch_add(1)) < batch->inputs.size(); ) {
+    batch->spare.pop(&frame);
+    auto start = chrono::steady_clock::now();
+    MappedImage input;
+    frame->file = file;
+    frame->ok = mapPPM(batch->inputs[file].c_str(), &input);
+    if (frame->ok) {
+      size_t pixels = (size_t)input.width * input.height;
+      frame->width = input.width;
+      frame->height = input.height;
+      frame->channels = input.channels;
+      frame->image.resize(pixels);
+      frame->output.resize(pixels);
+      if (input.channels == 3) {
+        memcpy(frame->image.data(), input.pixels, sizeof(Pixel) * pixels);
+      } else {
+        for (size_t i = 0; i < pixels; ++i) {
+          frame->image[i].r = frame->image[i].g = frame->image[i].b = input.pixels[i];
+        }
+      }
+      unmapPPM(&input);
+    }
+    busy += secondsSince(start);
+    batch->read.push(frame);
+  }
+  addBusy(batch, STAGE_READ, busy);
+  finishStage(batch, STAGE_READ, &batch->read);
+}
+
+static void filterFrames(Batch* batch) {
+  double busy = 0.0;
+  Frame* frame = NULL;
+  while (batch->read.pop(&frame)) {
+    auto start = chrono::steady_clock::now();
+    if (frame->ok && batch->fixedPoint)
+      gaussFilterFixed(frame->image.data(), frame->output.data(), frame->width, frame->height,
+                       batch->fixedWeights, batch->mode);
+    else if (frame->ok)
+      gaussFilter(frame->image.data(), frame->output.data(), frame->width, frame->height,
+                  *batch->weights, batch->mode);
+    busy += secondsSince(start);
+    batch->filtered.push(frame);
+  }
+  addBusy(batch, STAGE_FILTER, busy);
+  finishStage(batch, STAGE_FILTER, &batch->filtered);
+}
+
+static void writeFrames(Batch* batch) {
+  double busy = 0.0;
+  Frame* frame = NULL;
+  string out;   // reused, like the frames
+  while (batch->filtered.pop(&frame)) {
+    auto start = chrono::steady_clock::now();
+    const string& in = batch->inputs[frame->file];
+    size_t slash = in.rfind('/');
+    out.assign(batch->outDir);
+    out += '/';
+    out.append(in, (slash == string::npos) ? 0 : slash + 1, string::npos);
+    MappedImage result;
+    if (frame->ok && createPPM(out.c_str(), frame->width, frame->height, frame->channels, &result, NULL)) {
+      size_t pixels = (size_t)frame->width * frame->height;
+      if (frame->channels == 3) {
+        memcpy(result.pixels, frame->output.data(), sizeof(Pixel) * pixels);
+      } else {
+        for (size_t i = 0; i < pixels; ++i) {
+          result.pixels[i] = frame->output[i].r;
+        }
+      }
+      if (!unmapPPM(&result))
+        batch->failed.fetch_add(1);
+    } else {
+      batch->failed.fetch_add(1);
+    }
+    busy += secondsSince(start);
+    batch->spare.push(frame);
+  }
+  addBusy(batch, STAGE_WRITE, busy);
+  finishStage(batch, STAGE_WRITE, NULL);
+}
+
+/*
+The files to filter: the .ppm and .pgm files of a directory in name order, or the lines of
+a list file.
+*/
+bool listInputs(const char* path, vector<string>* inputs) {
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    cerr << "could not open " << path << endl;
+    return false;
+  }
+  if (S_ISDIR(info.st_mode)) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+      cerr << "could not open " << path << endl;
+      return false;
+    }
+    for (struct dirent* entry; (entry = readdir(dir)) != NULL; ) {
+      string name = entry->d_name;
+      if (name.size() > 4 && (name.compare(name.size() - 4, 4, ".ppm") == 0 ||
+                              name.compare(name.size() - 4, 4, ".pgm") == 0))
+        inputs->push_back(string(path) + "/" + name);
+    }
+    closedir(dir);
+    sort(inputs->begin(), inputs->end());
+  } else {
+    ifstream list(path);
+    for (string line; getline(list, line); ) {
+      if (!line.empty())
+        inputs->push_back(line);
+    }
+  }
+  return true;
+}
+
+/*
+Filters every input into outDir (created if missing) under its own file name with readers,
+filters and writers threads per stage. A single filter runs each image on the thread pool,
+several filters run one image each on a single thread, since the pool takes one job at a time.
+Prints images/s and how busy each stage was; fails if any image could not be read or written.
+*/
+bool batchFilter(const char* inputPath, const char* outDir, const vector<float>& weights, BorderMode mode,
+                 bool fixedPoint, int readers, int filters, int writers) {
+  int counts[3] = {max(readers, 1), max(filters, 1), max(writers, 1)};
+  // two frames more than workers, so that the readers can run ahead
+  int frameCount = counts[0] + counts[1] + counts[2] + 2;
+  Batch batch(frameCount);
+  if (!listInputs(inputPath, &batch.inputs))
+    return false;
+  if (mkdir(outDir, 0755) != 0 && errno != EEXIST) {
+    cerr << "could not create " << outDir << endl;
+    return false;
+  }
+  batch.outDir = outDir;
+  batch.weights = &weights;
+  batch.fixedWeights = quantizeWeights(weights);
+  batch.mode = mode;
+  batch.fixedPoint = fixedPoint;
+  batch.nextFile = 0;
+  batch.failed = 0;
+  vector<Frame> frames(frameCount);
+  for (Frame& frame : frames) {
+    batch.spare.push(&frame);
+  }
+  int savedThreads = filterThreads;
+  if (counts[1] > 1)
+    filterThreads = 1;
+  
+  static void (*const stages[3])(Batch*) = {readFrames, filterFrames, writeFrames};
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (int stage = 0; stage < 3; ++stage) {
+    batch.running[stage] = counts[stage];
+    batch.busy[stage] = 0.0;
+  }
+  for (int stage = 0; stage < 3; ++stage) {
+    for (int i = 0; i < counts[stage]; ++i) {
+      threads.push_back(thread(stages[stage], &batch));
+    }
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  double seconds = secondsSince(start);
+  filterThreads = savedThreads;
+  
+  static const char* names[3] = {"read", "filter", "write"};
+  size_t images = batch.inputs.size();
+  cout << images << " images in " << seconds << " s, " << images / seconds << " images/s" << endl;
+  for (int stage = 0; stage < 3; ++stage) {
+    cout << setw(8) << names[stage] << ": " << counts[stage] << " threads, "
+         << 100.0 * batch.busy[stage] / (seconds * counts[stage]) << "% busy" << endl;
+  }
+  if (batch.failed > 0)
+    cerr << batch.failed << " images failed" << endl;
+  return batch.failed == 0;
+}
+
+// end batch section
+// ######################################################
+
+/*
+gauss [-s sigma] [-r radius] [-b clamp|mirror|wrap|zero] [-k scalar|sse4.1|avx2|avx512]
+      [-j threads] [-f] [-p] [-c] [-t] [-T] [-S] [-B]
+      [input.ppm] [output.ppm] | -a [-P readers,filters,writers] [inputs] [outdir]
+The input may be a binary PPM (P6) or PGM (P5), the output has the same format. sigma must be
+positive (default 1).
+-j limits the number of threads (default: POOL_THREADS or all cpus), -T times the filter on
+the input for 1, 2, 4, ... threads instead of writing an output, -S streams the image row by
+row from input to output (either may be - for stdin or stdout) for images larger than memory,
+-B times loading and saving the input instead of filtering it,
+-a filters all images of the directory or list file inputs into outdir (default output) with a
+pipeline of reader, filter and writer threads (-P, default 1 reader, one filter per thread of
+the pool and 1 writer),
+-b selects the border mode (default clamp), -f uses 8-bit fixed-point arithmetic, -p filters
+in planar layout (converted from and to RGB, same result), -k forces row kernels instead of the best the cpu
+supports, -c additionally runs the 2D reference, compares the results and prints both times,
+-t only runs testKernels().
+*/
 int main(int argc, char** argv)
 {
-  const char*  inFilename = (argc > 1) ? argv[1] : "lena.ppm";
-  const char* outFilename = (argc > 2) ? argv[2] : "output.ppm";
+  float sigma = 1.0f;
+  int radius = -1;
+  BorderMode mode = BORDER_CLAMP;
+  bool compare = false, fixedPoint = false, sweep = false, stream = false, ioBench = false, batch = false, planar = false;
+  int readers = 1, filters = pool_threads(), writers = 1;
+  int opt;
+  bool usage = false;
+  while ((opt = getopt(argc, argv, "s:r:b:k:j:fpctTSBaP:")) != -1) {
+    switch (opt) {
+      case 's': sigma = atof(optarg); usage |= !(sigma > 0.0f); break;
+      case 'r': radius = atoi(optarg); break;
+      case 'c': compare = true; break;
+      case 'f': fixedPoint = true; break;
+      case 'p': planar = true; break;
+      case 'j': filterThreads = atoi(optarg); break;
+      case 'T': sweep = true; break;
+      case 'S': stream = true; break;
+      case 'B': ioBench = true; break;
+      case 'a': batch = true; break;
+      case 'P': usage |= sscanf(optarg, "%d,%d,%d", &readers, &filters, &writers) != 3; break;
+      case 't': return testKernels();
+      case 'b': usage |= !parseBorderMode(optarg, &mode); break;
+      case 'k': {
+        const RowKernels* forced = NULL;
+        for (int i = 0; i < kernelCount; ++i) {
+          if (strcmp(optarg, allKernels[i].name) == 0 && kernelSupported(&allKernels[i]))
+            forced = &allKernels[i];
+        }
+        if (forced != NULL)
+          rowKernels = forced;
+        else
+          usage = true;
+        break;
+      }
+      default: usage = true; break;
+    }
+  }
+  if (usage) {
+    cerr << "usage: " << argv[0] << " [-s sigma] [-r radius] [-b clamp|mirror|wrap|zero]"
+         << " [-k scalar|sse4.1|avx2|avx512] [-j threads] [-f] [-p] [-c] [-t] [-T] [-S] [-B]" << endl
+         << "       [input.ppm] [output.ppm] | -a [-P readers,filters,writers] [inputs] [outdir]" << endl;
+    return 1;
+  }
+  const char*  inFilename = (optind < argc) ? argv[optind] : "lena.ppm";
+  const char* outFilename = (optind + 1 < argc) ? argv[optind + 1] : "output.ppm";
+  if (radius < 0)
+    radius = defaultRadius(sigma);
   
-  float weights[5][5];
-  calculateWeights(weights);
-  int width;
-  int height;
+  vector<float> weights = calculateWeights(sigma, radius);
+  if (fixedPoint && !fixedWeightsFit(quantizeWeights(weights))) {
+    cerr << "sigma " << sigma << " needs more than " << MAX_FIXED_TAPS
+         << " weights, too many for fixed point; using float" << endl;
+    fixedPoint = false;
+  }
+  if (stream)
+    return gaussFilterStream(inFilename, outFilename, weights, mode, fixedPoint) ? 0 : 1;
+  if (ioBench)
+    return benchmarkIO(inFilename, outFilename) ? 0 : 1;
+  if (batch) {
+    bool ok = batchFilter(inFilename, (optind + 1 < argc) ? argv[optind + 1] : "output", weights, mode,
+                          fixedPoint, readers, filters, writers);
+    pool_shutdown();
+    return ok ? 0 : 1;
+  }
+  
+  MappedImage input, result;
+  if (!mapPPM(inFilename, &input))
+    return 1;
+  int width = input.width;
+  int height = input.height;
+  size_t pixels = (size_t)width * height;
+  
+  // the filter works on RGB, gray images are spread over three channels and back
+  const Pixel* image = (const Pixel*)input.pixels;
+  vector<Pixel> grayImage, grayOutput;
+  if (input.channels == 1) {
+    grayImage.resize(pixels);
+    grayOutput.resize(pixels);
+    for (size_t i = 0; i < pixels; ++i) {
+      grayImage[i].r = grayImage[i].g = grayImage[i].b = input.pixels[i];
+    }
+    image = grayImage.data();
+  }
   
-  Pixel* image = readPPM(inFilename, &width, &height);
+  if (sweep) {
+    vector<Pixel> output(pixels);
+    threadSweep(image, output.data(), width, height, weights, mode, fixedPoint);
+    unmapPPM(&input);
+    pool_shutdown();
+    return 0;
+  }
+  
+  // RGB is filtered straight into the mapped output file
+  if (!createPPM(outFilename, width, height, input.channels, &result, &input))
+    return 1;
+  Pixel* output = (input.channels == 1) ? grayOutput.data() : (Pixel*)result.pixels;
+  auto start = chrono::steady_clock::now();
+  if (planar)
+    gaussFilterPlanar(image, output, width, height, weights, mode, fixedPoint);
+  else if (fixedPoint)
+    gaussFilterFixed(image, output, width, height, quantizeWeights(weights), mode);
+  else
+    gaussFilter(image, output, width, height, weights, mode);
+  double separableTime = secondsSince(start);
   
-  gaussFilter(image, width, height, weights);
+  if (compare) {
+    Pixel* reference = (Pixel*)malloc(sizeof(Pixel) * width * height);
+    start = chrono::steady_clock::now();
+    gaussFilter2D(image, reference, width, height, weights, mode);
+    double referenceTime = secondsSince(start);
+    int diff = maxDifference(output, reference, width, height);
+    cout << width << "x" << height << ", sigma " << sigma << ", radius " << radius
+         << ": separable (" << rowKernels->name << (fixedPoint ? ", fixed point" : "") << (planar ? ", planar" : "") << ") " << separableTime << " s, 2D " << referenceTime
+         << " s, max difference " << diff << endl;
+    free(reference);
+    if (diff > 1) {
+      unmapPPM(&input);
+      unmapPPM(&result);
+      return 1;
+    }
+  }
   
-  writePPM(image, outFilename, width, height);
-  free(image); // must be explicitly freed
+  if (input.channels == 1) {
+    for (size_t i = 0; i < pixels; ++i) {
+      result.pixels[i] = grayOutput[i].r;
+    }
+  }
+  unmapPPM(&input);
+  bool written = unmapPPM(&result);
+  pool_shutdown();
+  return written ? 0 : 1;
 }
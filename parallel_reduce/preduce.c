@@ -1,15 +1,41 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
 
-#include <pthread.h>
+#include "wsched.h"
 
-#define NUM_THREADS (5)
-
-struct ThreadData {
-    int (*op)(int, int);
-    int *data;
-    int len;
-    int result;
-};
+// number of calls in the dispatch overhead measurement
+#define DISPATCH_CALLS (10000)
+// default minimum number of elements per chunk, below twice this a reduction runs sequentially
+#define PREDUCE_GRAIN (32768)
+// elements per block of the reproducible reductions, fixed so that results never depend on threads
+#define REPRO_BLOCK (4096)
+// depth of the pairwise combine tree, enough for 2^64 blocks
+#define REPRO_LEVELS (64)
+// longest input of the exhaustive length test
+#define TEST_MAX_LEN (1000)
+// number of elements of the random test array
+#define TEST_LEN (10000000)
+// longest input of the crossover benchmark sweep
+#define BENCH_MAX_LEN (1 << 24)
+// elements reduced per point of the sweep (spread over several calls for short inputs)
+#define BENCH_WORK (1 << 23)
+// input lengths of the scan benchmark run from 10^6 up to this
+#define SCAN_MAX_LEN (1000000000L)
+// ints read per pass of the bandwidth benchmark (256 MB)
+#define BANDWIDTH_LEN (1 << 26)
+// passes of the bandwidth benchmark, the fastest one counts
+#define BANDWIDTH_RUNS (5)
+// the slow thread of the imbalance benchmark needs this many times as long per element
+#define SLOW_FACTOR (4)
+// repetitions of the imbalance benchmark
+#define IMBALANCE_RUNS (25)
 
 
 int max(int a, int b)
@@ -22,6 +48,10 @@ int sum(int a, int b)
   return a+b;
 }
 
+/*
+Sequential reference implementation, len must be at least 1.
+Every element costs an indirect call of op, so the compiler can neither inline nor vectorize it.
+*/
 int reduce(int (*op)(int, int),
            int *data,
            int len)
@@ -33,47 +63,971 @@ int reduce(int (*op)(int, int),
   return result;
 }
 
-void *thread_reduce(void *threadArg) {
-    struct ThreadData *data = (struct ThreadData *)threadArg;
-    // reuse sequential reduce implementation
-    data->result = reduce(data->op, data->data, data->len);
-    pthread_exit(NULL);
+// Sequential reference scan: out[i] = op(data[0], ..., data[i]), len must be at least 1.
+void scan(int (*op)(int, int),
+          int *data,
+          int *out,
+          int len)
+{
+  int i;
+  out[0] = data[0];
+  for (i = 1; i < len; ++i)
+    out[i] = op(out[i - 1], data[i]);
 }
 
-int parallel_reduce(int (*op)(int, int), 
-                    int *data, 
-                    int len) 
-{
-    pthread_t threads[NUM_THREADS];  // generate identifier for each thread
-    struct ThreadData threadData[NUM_THREADS];  // generate ThreadData for each Thread
-    int i;
-
-    /* 
-    Split data among threads
-    Each Thread obtains its own sub array as parameter
-    */
-    int chunkSize = len / NUM_THREADS;
-    for (i = 0; i < NUM_THREADS; ++i) {
-        threadData[i].op = op;
-        threadData[i].data = data + i * chunkSize;
-        threadData[i].len = (i == NUM_THREADS - 1) ? (len - i * chunkSize) : chunkSize;
-        // create thread
-        pthread_create(&threads[i], NULL, thread_reduce, (void *)&threadData[i]);
+// ######################################################
+// Start partitioning section
+
+// minimum number of elements per chunk, can be lowered to force parallel runs in tests
+size_t reduce_grain = PREDUCE_GRAIN;
+
+/*
+Number of chunks for len elements: at most one per thread and each at least reduce_grain
+elements long. 1 means the input is too small to be worth the dispatch, run it sequentially.
+*/
+int chunk_count(size_t len) {
+    size_t grain = (reduce_grain > 0) ? reduce_grain : 1;
+    size_t chunks = len / grain;
+    size_t threads = (size_t)pool_threads();
+    if (chunks > threads)
+        chunks = threads;
+    return (chunks > 1) ? (int)chunks : 1;
+}
+
+/*
+First element of chunk i when len elements are split into chunks parts.
+The remainder len % chunks is spread over the first chunks, so lengths differ by at most one.
+*/
+static inline size_t chunk_begin(size_t len, int chunks, int i) {
+    size_t q = len / chunks, r = len % chunks;
+    return i * q + (((size_t)i < r) ? (size_t)i : r);
+}
+
+struct FirstTouch {
+    char *data;
+    size_t len;
+    size_t elemSize;
+};
+
+static void first_touch_chunk(void *arg, int self) {
+    struct FirstTouch *job = (struct FirstTouch *)arg;
+    size_t begin = chunk_begin(job->len, pool_threads(), self);
+    size_t end = chunk_begin(job->len, pool_threads(), self + 1);
+    memset(job->data + begin * job->elemSize, 0, (end - begin) * job->elemSize);
+}
+
+/*
+Zeroes fresh memory of len elements with the chunk of every thread written by that thread.
+With a pinned pool (POOL_PIN=1) the kernel places each page on the node of the thread that
+touched it first, which is also the thread that reduces this chunk in parallel_reduce_placed.
+*/
+void first_touch(void *data, size_t len, size_t elemSize) {
+    struct FirstTouch job;
+    job.data = (char *)data;
+    job.len = len;
+    job.elemSize = elemSize;
+    run_on_threads(first_touch_chunk, &job);
+}
+
+// end partitioning section
+// ######################################################
+
+// ######################################################
+// Start typed reduction section
+
+/*
+Operators as macros, so that they are inlined into the reduction loops.
+Every operator must be associative; the caller passes its identity element
+(0 for sum, 1 for prod, the smallest value of the type for max, the largest for min).
+*/
+#define OP_SUM(a, b) ((a) + (b))
+#define OP_PROD(a, b) ((a) * (b))
+#define OP_MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define OP_MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// number of independent accumulators in the sequential kernel
+#define LANES (8)
+
+/*
+Generates for one operator OP on element type T:
+  T reduce_NAME(const T *data, size_t len, T identity)
+  T parallel_reduce_NAME(const T *data, size_t len, T identity)
+  T parallel_reduce_static_NAME(const T *data, size_t len, T identity)
+  T parallel_reduce_placed_NAME(const T *data, size_t len, T identity)
+  const T identity_NAME
+All return identity for len == 0.
+The sequential kernel keeps LANES independent accumulators. That breaks the dependency chain
+of the single accumulator, and since the lanes are explicit in the source the compiler may
+vectorize them even for float/double where it must not reorder the additions on its own.
+*/
+#define DEFINE_REDUCE(NAME, T, OP, IDENTITY)                                    \
+const T identity_##NAME = IDENTITY;                                             \
+                                                                                \
+T reduce_##NAME(const T *data, size_t len, T identity)                          \
+{                                                                               \
+    T acc[LANES];                                                               \
+    size_t i;                                                                   \
+    int k;                                                                      \
+    for (k = 0; k < LANES; ++k)                                                 \
+        acc[k] = identity;                                                      \
+    for (i = 0; i + LANES <= len; i += LANES)                                   \
+        for (k = 0; k < LANES; ++k)                                             \
+            acc[k] = OP(acc[k], data[i + k]);                                   \
+    T result = identity;                                                        \
+    for (k = 0; k < LANES; ++k)                                                 \
+        result = OP(result, acc[k]);                                            \
+    for (; i < len; ++i)                                                        \
+        result = OP(result, data[i]);                                           \
+    return result;                                                              \
+}                                                                               \
+                                                                                \
+struct ReduceJob_##NAME {                                                       \
+    const T *data;                                                              \
+    size_t len;                                                                 \
+    T identity;                                                                 \
+    int chunks;                                                                 \
+    /* one partial result per chunk (static) or per thread (work stealing), */  \
+    /* each on its own cache line so that the threads do not false-share */     \
+    struct { _Alignas(CACHE_LINE) T value; } results[MAX_THREADS];              \
+};                                                                              \
+                                                                                \
+static void reduce_chunk_##NAME(void *arg, int i)                               \
+{                                                                               \
+    struct ReduceJob_##NAME *job = (struct ReduceJob_##NAME *)arg;              \
+    size_t begin = chunk_begin(job->len, job->chunks, i);                       \
+    size_t end = chunk_begin(job->len, job->chunks, i + 1);                     \
+    job->results[i].value = reduce_##NAME(job->data + begin, end - begin, job->identity); \
+}                                                                               \
+                                                                                \
+static void reduce_range_##NAME(void *arg, size_t begin, size_t end, int self)  \
+{                                                                               \
+    struct ReduceJob_##NAME *job = (struct ReduceJob_##NAME *)arg;              \
+    T partial = reduce_##NAME(job->data + begin, end - begin, job->identity);   \
+    job->results[self].value = OP(job->results[self].value, partial);                       \
+}                                                                               \
+                                                                                \
+/* one chunk per thread, fast if all threads progress at the same speed */      \
+T parallel_reduce_static_##NAME(const T *data, size_t len, T identity)          \
+{                                                                               \
+    struct ReduceJob_##NAME job;                                                \
+    int i;                                                                      \
+    job.chunks = chunk_count(len);                                              \
+    /* small inputs: the dispatch would cost more than it saves */              \
+    if (job.chunks == 1)                                                        \
+        return reduce_##NAME(data, len, identity);                              \
+    job.data = data;                                                            \
+    job.len = len;                                                              \
+    job.identity = identity;                                                    \
+    run_chunks(reduce_chunk_##NAME, &job, job.chunks);                          \
+    /* concatenate results */                                                   \
+    T result = identity;                                                        \
+    for (i = 0; i < job.chunks; ++i)                                            \
+        result = OP(result, job.results[i].value);                              \
+    return result;                                                              \
+}                                                                               \
+                                                                                \
+/* ranges of reduce_grain elements handed out by work stealing */               \
+T parallel_reduce_##NAME(const T *data, size_t len, T identity)                 \
+{                                                                               \
+    struct ReduceJob_##NAME job;                                                \
+    int i, threads;                                                             \
+    if (chunk_count(len) == 1)                                                  \
+        return reduce_##NAME(data, len, identity);                              \
+    threads = pool_threads();                                                   \
+    job.data = data;                                                            \
+    job.len = len;                                                              \
+    job.identity = identity;                                                    \
+    for (i = 0; i < threads; ++i)                                               \
+        job.results[i].value = identity;                                        \
+    ws_parallel_for(len, reduce_grain, reduce_range_##NAME, &job);              \
+    T result = identity;                                                        \
+    for (i = 0; i < threads; ++i)                                               \
+        result = OP(result, job.results[i].value);                              \
+    return result;                                                              \
+}                                                                               \
+                                                                                \
+static void reduce_placed_##NAME(void *arg, int self)                           \
+{                                                                               \
+    struct ReduceJob_##NAME *job = (struct ReduceJob_##NAME *)arg;              \
+    size_t begin = chunk_begin(job->len, job->chunks, self);                    \
+    size_t end = chunk_begin(job->len, job->chunks, self + 1);                  \
+    job->results[self].value = reduce_##NAME(job->data + begin, end - begin, job->identity); \
+}                                                                               \
+                                                                                \
+/* chunk i on thread i, for data placed with first_touch */                     \
+T parallel_reduce_placed_##NAME(const T *data, size_t len, T identity)          \
+{                                                                               \
+    struct ReduceJob_##NAME job;                                                \
+    int i;                                                                      \
+    job.data = data;                                                            \
+    job.len = len;                                                              \
+    job.identity = identity;                                                    \
+    job.chunks = pool_threads();                                                \
+    run_on_threads(reduce_placed_##NAME, &job);                                 \
+    T result = identity;                                                        \
+    for (i = 0; i < job.chunks; ++i)                                            \
+        result = OP(result, job.results[i].value);                              \
+    return result;                                                              \
+}
+
+// all operator/type combinations with their identity elements
+#define FOR_ALL_REDUCTIONS(X)                                                   \
+    X(sum_int, int, OP_SUM, 0) X(prod_int, int, OP_PROD, 1)                     \
+    X(max_int, int, OP_MAX, INT_MIN) X(min_int, int, OP_MIN, INT_MAX)           \
+    X(sum_int64, int64_t, OP_SUM, 0) X(prod_int64, int64_t, OP_PROD, 1)         \
+    X(max_int64, int64_t, OP_MAX, INT64_MIN) X(min_int64, int64_t, OP_MIN, INT64_MAX) \
+    X(sum_float, float, OP_SUM, 0.0f) X(prod_float, float, OP_PROD, 1.0f)       \
+    X(max_float, float, OP_MAX, -INFINITY) X(min_float, float, OP_MIN, INFINITY) \
+    X(sum_double, double, OP_SUM, 0.0) X(prod_double, double, OP_PROD, 1.0)     \
+    X(max_double, double, OP_MAX, -INFINITY) X(min_double, double, OP_MIN, INFINITY)
+
+FOR_ALL_REDUCTIONS(DEFINE_REDUCE)
+
+/*
+Type-generic front end: parallel_reduce(sum, data, len, 0) picks parallel_reduce_sum_int
+for an int array, parallel_reduce_sum_double for a double array and so on.
+An unsupported element type is a compile error.
+*/
+#define TYPED_REDUCE(PREFIX, OP, data)                                          \
+    _Generic(*(data),                                                           \
+             int: PREFIX##OP##_int,                                             \
+             int64_t: PREFIX##OP##_int64,                                       \
+             float: PREFIX##OP##_float,                                         \
+             double: PREFIX##OP##_double)
+
+#define typed_reduce(OP, data, len, identity) \
+    TYPED_REDUCE(reduce_, OP, data)((data), (len), (identity))
+#define parallel_reduce(OP, data, len, identity) \
+    TYPED_REDUCE(parallel_reduce_, OP, data)((data), (len), (identity))
+// identity element of OP for the element type of data, e.g. reduce_identity(max, ints) == INT_MIN
+#define reduce_identity(OP, data) TYPED_REDUCE(identity_, OP, data)
+
+// end typed reduction section
+// ######################################################
+
+// ######################################################
+// Start fused reduction section
+
+/*
+Generates for element type T:
+  struct ReduceStats_S { T sum, min, max; size_t count; double sumSquares; }
+  struct ReduceStats_S reduce_stats_S(const T *data, size_t len)
+  struct ReduceStats_S parallel_reduce_stats_S(const T *data, size_t len)
+All five reductions in a single pass. Separate calls of parallel_reduce would stream a large
+array from memory once per operator; here every element is loaded once. sumSquares is
+accumulated in double, so that it does not overflow for integer types.
+*/
+#define DEFINE_STATS(S, T, MIN_ID, MAX_ID)                                      \
+struct ReduceStats_##S {                                                        \
+    T sum;                                                                      \
+    T min;                                                                      \
+    T max;                                                                      \
+    size_t count;                                                               \
+    double sumSquares;                                                          \
+};                                                                              \
+                                                                                \
+static inline struct ReduceStats_##S stats_identity_##S(void)                   \
+{                                                                               \
+    struct ReduceStats_##S stats = {0, MIN_ID, MAX_ID, 0, 0.0};                 \
+    return stats;                                                               \
+}                                                                               \
+                                                                                \
+static inline struct ReduceStats_##S stats_combine_##S(struct ReduceStats_##S a, \
+                                                       struct ReduceStats_##S b) \
+{                                                                               \
+    a.sum = OP_SUM(a.sum, b.sum);                                               \
+    a.min = OP_MIN(a.min, b.min);                                               \
+    a.max = OP_MAX(a.max, b.max);                                               \
+    a.count += b.count;                                                         \
+    a.sumSquares += b.sumSquares;                                               \
+    return a;                                                                   \
+}                                                                               \
+                                                                                \
+struct ReduceStats_##S reduce_stats_##S(const T *data, size_t len)              \
+{                                                                               \
+    T sum[LANES], mn[LANES], mx[LANES];                                         \
+    double sq[LANES];                                                           \
+    size_t i;                                                                   \
+    int k;                                                                      \
+    for (k = 0; k < LANES; ++k) {                                               \
+        sum[k] = 0;                                                             \
+        mn[k] = MIN_ID;                                                         \
+        mx[k] = MAX_ID;                                                         \
+        sq[k] = 0.0;                                                            \
+    }                                                                           \
+    for (i = 0; i + LANES <= len; i += LANES)                                   \
+        for (k = 0; k < LANES; ++k) {                                           \
+            T x = data[i + k];                                                  \
+            sum[k] = OP_SUM(sum[k], x);                                         \
+            mn[k] = OP_MIN(mn[k], x);                                           \
+            mx[k] = OP_MAX(mx[k], x);                                           \
+            sq[k] += (double)x * (double)x;                                     \
+        }                                                                       \
+    struct ReduceStats_##S stats = stats_identity_##S();                        \
+    for (k = 0; k < LANES; ++k) {                                               \
+        stats.sum = OP_SUM(stats.sum, sum[k]);                                  \
+        stats.min = OP_MIN(stats.min, mn[k]);                                   \
+        stats.max = OP_MAX(stats.max, mx[k]);                                   \
+        stats.sumSquares += sq[k];                                              \
+    }                                                                           \
+    for (; i < len; ++i) {                                                      \
+        stats.sum = OP_SUM(stats.sum, data[i]);                                 \
+        stats.min = OP_MIN(stats.min, data[i]);                                 \
+        stats.max = OP_MAX(stats.max, data[i]);                                 \
+        stats.sumSquares += (double)data[i] * (double)data[i];                  \
+    }                                                                           \
+    stats.count = len;                                                          \
+    return stats;                                                               \
+}                                                                               \
+                                                                                \
+struct StatsJob_##S {                                                           \
+    const T *data;                                                              \
+    struct { _Alignas(CACHE_LINE) struct ReduceStats_##S value; } results[MAX_THREADS]; \
+};                                                                              \
+                                                                                \
+static void stats_range_##S(void *arg, size_t begin, size_t end, int self)      \
+{                                                                               \
+    struct StatsJob_##S *job = (struct StatsJob_##S *)arg;                      \
+    job->results[self].value = stats_combine_##S(job->results[self].value,      \
+        reduce_stats_##S(job->data + begin, end - begin));                      \
+}                                                                               \
+                                                                                \
+struct ReduceStats_##S parallel_reduce_stats_##S(const T *data, size_t len)     \
+{                                                                               \
+    struct StatsJob_##S job;                                                    \
+    int i, threads;                                                             \
+    if (chunk_count(len) == 1)                                                  \
+        return reduce_stats_##S(data, len);                                     \
+    threads = pool_threads();                                                   \
+    job.data = data;                                                            \
+    for (i = 0; i < threads; ++i)                                               \
+        job.results[i].value = stats_identity_##S();                            \
+    ws_parallel_for(len, reduce_grain, stats_range_##S, &job);                  \
+    struct ReduceStats_##S result = stats_identity_##S();                       \
+    for (i = 0; i < threads; ++i)                                               \
+        result = stats_combine_##S(result, job.results[i].value);               \
+    return result;                                                              \
+}
+
+DEFINE_STATS(int, int, INT_MAX, INT_MIN)
+DEFINE_STATS(int64, int64_t, INT64_MAX, INT64_MIN)
+DEFINE_STATS(float, float, INFINITY, -INFINITY)
+DEFINE_STATS(double, double, INFINITY, -INFINITY)
+
+// type-generic front ends, e.g. struct ReduceStats_int s = parallel_reduce_stats(ints, len)
+#define typed_reduce_stats(data, len) TYPED_REDUCE(reduce_, stats, data)((data), (len))
+#define parallel_reduce_stats(data, len) TYPED_REDUCE(parallel_reduce_, stats, data)((data), (len))
+
+// end fused reduction section
+// ######################################################
+
+// ######################################################
+// Start reproducible reduction section
+
+/*
+Generates for the operators of FOR_ALL_REDUCTIONS:
+  T reduce_repro_NAME(const T *data, size_t len, T identity)
+  T parallel_reduce_repro_NAME(const T *data, size_t len, T identity)
+Floating-point addition and multiplication are not associative, so parallel_reduce gives results
+that depend on the number of threads and on which thread stole what. These two always give the
+same bits, for any number of threads and grain: the input is cut into blocks of REPRO_BLOCK
+elements, each block is reduced by the fixed code of reduce_NAME, and the block results are
+combined in a fixed pairwise tree (block results are pushed in order; two subtrees of equal
+size merge as soon as they exist). Threads only decide who computes a block result, not how.
+This holds as long as the program is not built with -ffast-math or similar.
+*/
+#define DEFINE_REPRO(NAME, T, OP, IDENTITY)                                     \
+struct ReproTree_##NAME {                                                       \
+    T values[REPRO_LEVELS];                                                     \
+    int levels[REPRO_LEVELS];                                                   \
+    int depth;                                                                  \
+};                                                                              \
+                                                                                \
+static inline void repro_push_##NAME(struct ReproTree_##NAME *tree, T value)    \
+{                                                                               \
+    int level = 0;                                                              \
+    while (tree->depth > 0 && tree->levels[tree->depth - 1] == level) {         \
+        value = OP(tree->values[--tree->depth], value);                         \
+        ++level;                                                                \
+    }                                                                           \
+    tree->values[tree->depth] = value;                                          \
+    tree->levels[tree->depth++] = level;                                        \
+}                                                                               \
+                                                                                \
+/* the remaining subtrees, smallest (rightmost) first */                        \
+static inline T repro_finish_##NAME(struct ReproTree_##NAME *tree, T identity)  \
+{                                                                               \
+    if (tree->depth == 0)                                                       \
+        return identity;                                                        \
+    T result = tree->values[--tree->depth];                                     \
+    while (tree->depth > 0)                                                     \
+        result = OP(tree->values[--tree->depth], result);                       \
+    return result;                                                              \
+}                                                                               \
+                                                                                \
+T reduce_repro_##NAME(const T *data, size_t len, T identity)                    \
+{                                                                               \
+    struct ReproTree_##NAME tree;                                               \
+    size_t i;                                                                   \
+    tree.depth = 0;                                                             \
+    for (i = 0; i < len; i += REPRO_BLOCK)                                      \
+        repro_push_##NAME(&tree, reduce_##NAME(data + i,                        \
+            (len - i < REPRO_BLOCK) ? len - i : REPRO_BLOCK, identity));        \
+    return repro_finish_##NAME(&tree, identity);                                \
+}                                                                               \
+                                                                                \
+struct ReproJob_##NAME {                                                        \
+    const T *data;                                                              \
+    size_t len;                                                                 \
+    T identity;                                                                 \
+    T *blocks;                                                                  \
+};                                                                              \
+                                                                                \
+static void repro_blocks_##NAME(void *arg, size_t begin, size_t end, int self)  \
+{                                                                               \
+    struct ReproJob_##NAME *job = (struct ReproJob_##NAME *)arg;                \
+    size_t b;                                                                   \
+    (void)self;                                                                 \
+    for (b = begin; b < end; ++b) {                                             \
+        size_t first = b * REPRO_BLOCK;                                         \
+        size_t n = (job->len - first < REPRO_BLOCK) ? job->len - first : REPRO_BLOCK; \
+        job->blocks[b] = reduce_##NAME(job->data + first, n, job->identity);    \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+T parallel_reduce_repro_##NAME(const T *data, size_t len, T identity)           \
+{                                                                               \
+    struct ReproJob_##NAME job;                                                 \
+    struct ReproTree_##NAME tree;                                               \
+    size_t blocks = (len + REPRO_BLOCK - 1) / REPRO_BLOCK, b;                   \
+    if (chunk_count(len) == 1)                                                  \
+        return reduce_repro_##NAME(data, len, identity);                        \
+    job.data = data;                                                            \
+    job.len = len;                                                              \
+    job.identity = identity;                                                    \
+    job.blocks = (T *)malloc(sizeof(T) * blocks);                               \
+    if (job.blocks == NULL)                                                     \
+        exit(-1);                                                               \
+    ws_parallel_for(blocks, (reduce_grain + REPRO_BLOCK - 1) / REPRO_BLOCK,     \
+                    repro_blocks_##NAME, &job);                                 \
+    tree.depth = 0;                                                             \
+    for (b = 0; b < blocks; ++b)                                                \
+        repro_push_##NAME(&tree, job.blocks[b]);                                \
+    free(job.blocks);                                                           \
+    return repro_finish_##NAME(&tree, identity);                                \
+}
+
+FOR_ALL_REDUCTIONS(DEFINE_REPRO)
+
+// type-generic front ends like parallel_reduce, e.g. parallel_reduce_repro(sum, doubles, len, 0.0)
+#define typed_reduce_repro(OP, data, len, identity) \
+    TYPED_REDUCE(reduce_repro_, OP, data)((data), (len), (identity))
+#define parallel_reduce_repro(OP, data, len, identity) \
+    TYPED_REDUCE(parallel_reduce_repro_, OP, data)((data), (len), (identity))
+
+// end reproducible reduction section
+// ######################################################
+
+// ######################################################
+// Start scan section
+
+enum ScanKind {
+    // out[i] = OP(data[0], ..., data[i])
+    SCAN_INCLUSIVE,
+    // out[i] = OP(identity, data[0], ..., data[i-1])
+    SCAN_EXCLUSIVE
+};
+
+/*
+Generates for the operators of FOR_ALL_REDUCTIONS:
+  void scan_NAME(const T *data, T *out, size_t len, T identity, enum ScanKind kind)
+  void parallel_scan_NAME(const T *data, T *out, size_t len, T identity, enum ScanKind kind)
+out may be data itself.
+The parallel version is the two-pass blocked scan: every chunk but the last is reduced with the
+vectorized reduce_NAME, the chunk totals are scanned sequentially into the carry of each chunk,
+and then every chunk is scanned starting from its carry. It reads the input twice, so it only
+pays off once the chunks are spread over enough cores to outrun the sequential scan.
+*/
+#define DEFINE_SCAN(NAME, T, OP, IDENTITY)                                      \
+/* scans len elements starting from acc, returns the total */                   \
+static inline T scan_block_##NAME(const T *data, T *out, size_t len, T acc,     \
+                                  enum ScanKind kind)                           \
+{                                                                               \
+    size_t i;                                                                   \
+    if (kind == SCAN_INCLUSIVE) {                                               \
+        for (i = 0; i < len; ++i)                                               \
+            out[i] = acc = OP(acc, data[i]);                                    \
+    } else {                                                                    \
+        for (i = 0; i < len; ++i) {                                             \
+            T next = OP(acc, data[i]);                                          \
+            out[i] = acc;                                                       \
+            acc = next;                                                         \
+        }                                                                       \
+    }                                                                           \
+    return acc;                                                                 \
+}                                                                               \
+                                                                                \
+void scan_##NAME(const T *data, T *out, size_t len, T identity, enum ScanKind kind) \
+{                                                                               \
+    scan_block_##NAME(data, out, len, identity, kind);                          \
+}                                                                               \
+                                                                                \
+struct ScanJob_##NAME {                                                         \
+    const T *data;                                                              \
+    T *out;                                                                     \
+    size_t len;                                                                 \
+    T identity;                                                                 \
+    enum ScanKind kind;                                                         \
+    int chunks;                                                                 \
+    /* totals of the chunks in pass one, carries into the chunks in pass two */ \
+    /* (each on its own cache line, like the results of a reduction) */        \
+    struct { _Alignas(CACHE_LINE) T value; } partials[MAX_THREADS];             \
+};                                                                              \
+                                                                                \
+static void scan_reduce_chunk_##NAME(void *arg, int i)                          \
+{                                                                               \
+    struct ScanJob_##NAME *job = (struct ScanJob_##NAME *)arg;                  \
+    size_t begin = chunk_begin(job->len, job->chunks, i);                       \
+    size_t end = chunk_begin(job->len, job->chunks, i + 1);                     \
+    /* the total of the last chunk is never needed */                           \
+    if (i < job->chunks - 1)                                                    \
+        job->partials[i].value = reduce_##NAME(job->data + begin, end - begin, job->identity); \
+}                                                                               \
+                                                                                \
+static void scan_chunk_##NAME(void *arg, int i)                                 \
+{                                                                               \
+    struct ScanJob_##NAME *job = (struct ScanJob_##NAME *)arg;                  \
+    size_t begin = chunk_begin(job->len, job->chunks, i);                       \
+    size_t end = chunk_begin(job->len, job->chunks, i + 1);                     \
+    scan_block_##NAME(job->data + begin, job->out + begin, end - begin,         \
+                      job->partials[i].value, job->kind);                       \
+}                                                                               \
+                                                                                \
+void parallel_scan_##NAME(const T *data, T *out, size_t len, T identity, enum ScanKind kind) \
+{                                                                               \
+    struct ScanJob_##NAME job;                                                  \
+    int i;                                                                      \
+    job.chunks = chunk_count(len);                                              \
+    if (job.chunks == 1) {                                                      \
+        scan_block_##NAME(data, out, len, identity, kind);                      \
+        return;                                                                 \
+    }                                                                           \
+    job.data = data;                                                            \
+    job.out = out;                                                              \
+    job.len = len;                                                              \
+    job.identity = identity;                                                    \
+    job.kind = kind;                                                            \
+    job.partials[job.chunks - 1].value = identity;                              \
+    run_chunks(scan_reduce_chunk_##NAME, &job, job.chunks);                     \
+    /* exclusive scan of the chunk totals gives the carry into each chunk */    \
+    T carry = identity;                                                         \
+    for (i = 0; i < job.chunks; ++i) {                                          \
+        T total = job.partials[i].value;                                        \
+        job.partials[i].value = carry;                                          \
+        carry = OP(carry, total);                                               \
+    }                                                                           \
+    run_chunks(scan_chunk_##NAME, &job, job.chunks);                            \
+}
+
+FOR_ALL_REDUCTIONS(DEFINE_SCAN)
+
+// type-generic front ends like parallel_reduce, e.g. parallel_scan(sum, data, out, len, 0, SCAN_INCLUSIVE)
+#define typed_scan(OP, data, out, len, identity, kind) \
+    TYPED_REDUCE(scan_, OP, data)((data), (out), (len), (identity), (kind))
+#define parallel_scan(OP, data, out, len, identity, kind) \
+    TYPED_REDUCE(parallel_scan_, OP, data)((data), (out), (len), (identity), (kind))
+
+// end scan section
+// ######################################################
+
+// fill data with len random values in [-range, range]
+void fill(int *data, int len, int range) {
+  int i;
+  for (i = 0; i < len; ++i)
+    data[i] = rand() % (2 * range + 1) - range;
+}
+
+// compares a parallel result against its reference
+int check(const char *name, double result, double reference, double tolerance) {
+  if (fabs(result - reference) > tolerance * fabs(reference)) {
+    printf("%s: %f : %f\n", name, result, reference);
+    return 1;
+  }
+  return 0;
+}
+
+// compares a scan against its reference, reports the first difference
+int check_scan(const char *name, const int *out, const int *ref, int len) {
+  int i;
+  for (i = 0; i < len; ++i) {
+    if (out[i] != ref[i]) {
+      printf("%s of length %d: %d : %d at %d\n", name, len, out[i], ref[i], i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+double seconds_since(struct timeval *start) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void empty_task(void *arg, int i) {
+  (void)arg; (void)i;
+}
+
+/*
+The reproducible float and double sums must give the same bits as their sequential versions
+for lengths around multiples of REPRO_BLOCK and for any grain.
+*/
+int test_repro(void) {
+  static const size_t grains[] = {1, REPRO_BLOCK, 3 * REPRO_BLOCK, PREDUCE_GRAIN};
+  static const size_t lengths[] = {REPRO_BLOCK - 1, REPRO_BLOCK, 5 * REPRO_BLOCK + 1,
+                                   37 * REPRO_BLOCK + 123, 1000 * REPRO_BLOCK + 7};
+  size_t maxLen = lengths[sizeof(lengths) / sizeof(lengths[0]) - 1], i, g, l;
+  double *doubles = (double *)malloc(sizeof(double) * maxLen);
+  float *floats = (float *)malloc(sizeof(float) * maxLen);
+  int errors = 0;
+  if (doubles == NULL || floats == NULL)
+    exit(-1);
+  // fractions of very different magnitude, so that the order of the additions matters
+  for (i = 0; i < maxLen; ++i) {
+    doubles[i] = (rand() - RAND_MAX / 2) * pow(2.0, rand() % 40 - 20);
+    floats[i] = (float)doubles[i];
+  }
+  for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+    double d = typed_reduce_repro(sum, doubles, lengths[l], 0.0);
+    float f = typed_reduce_repro(sum, floats, lengths[l], 0.0f);
+    for (g = 0; g < sizeof(grains) / sizeof(grains[0]); ++g) {
+      reduce_grain = grains[g];
+      double pd = parallel_reduce_repro(sum, doubles, lengths[l], 0.0);
+      float pf = parallel_reduce_repro(sum, floats, lengths[l], 0.0f);
+      if (memcmp(&pd, &d, sizeof(d)) != 0 || memcmp(&pf, &f, sizeof(f)) != 0) {
+        printf("repro sum of length %zu, grain %zu: %a : %a, %a : %a\n",
+               lengths[l], grains[g], pd, d, pf, f);
+        ++errors;
+      }
+    }
+  }
+  reduce_grain = PREDUCE_GRAIN;
+  free(doubles); free(floats);
+  return errors;
+}
+
+/*
+Compares parallel_reduce and parallel_scan with plain loops for every length 0..TEST_MAX_LEN,
+once with the default grain and once with grain 1 which makes even tiny inputs parallel and
+exercises maximal splitting: work stealing cuts the input down to one-element tasks.
+*/
+int test_lengths(void) {
+  int ints[TEST_MAX_LEN], signs[TEST_MAX_LEN], ref[TEST_MAX_LEN], out[TEST_MAX_LEN];
+  double doubles[TEST_MAX_LEN];
+  int errors = 0, pass, len, i;
+  fill(ints, TEST_MAX_LEN, 1000);
+  for (i = 0; i < TEST_MAX_LEN; ++i) {
+    doubles[i] = ints[i] * 0.5;
+    // products of +-1 cannot overflow
+    signs[i] = (ints[i] & 1) ? -1 : 1;
+  }
+  for (pass = 0; pass < 2; ++pass) {
+    // pass 1: maximal splitting, every element a task of its own
+    reduce_grain = (pass == 0) ? PREDUCE_GRAIN : 1;
+    for (len = 0; len <= TEST_MAX_LEN; ++len) {
+      int iSum = 0, iMax = INT_MIN, iMin = INT_MAX, iProd = 1;
+      double dSum = 0, dMax = -INFINITY;
+      for (i = 0; i < len; ++i) {
+        iSum += ints[i];
+        iMax = max(iMax, ints[i]);
+        iMin = (ints[i] < iMin) ? ints[i] : iMin;
+        iProd *= signs[i];
+        dSum += doubles[i];
+        dMax = (doubles[i] > dMax) ? doubles[i] : dMax;
+      }
+      errors += check("sum int", parallel_reduce(sum, ints, len, reduce_identity(sum, ints)), iSum, 0);
+      errors += check("max int", parallel_reduce(max, ints, len, reduce_identity(max, ints)), iMax, 0);
+      errors += check("min int", parallel_reduce(min, ints, len, reduce_identity(min, ints)), iMin, 0);
+      errors += check("prod int", parallel_reduce(prod, signs, len, reduce_identity(prod, signs)), iProd, 0);
+      // halves of integers below 2^53 add up exactly in any order
+      errors += check("sum double", parallel_reduce(sum, doubles, len, 0.0), dSum, 0);
+      if (len > 0)
+        errors += check("max double", parallel_reduce(max, doubles, len, reduce_identity(max, doubles)), dMax, 0);
+      else if (parallel_reduce(max, doubles, len, reduce_identity(max, doubles)) != -INFINITY)
+        ++errors;
+      if (len > 0) {
+        scan(sum, ints, ref, len);
+        parallel_scan(sum, ints, out, len, 0, SCAN_INCLUSIVE);
+        errors += check_scan("inclusive sum scan", out, ref, len);
+        parallel_scan(sum, ints, out, len, 0, SCAN_EXCLUSIVE);
+        errors += (out[0] != 0) + check_scan("exclusive sum scan", out + 1, ref, len - 1);
+        scan(max, ints, ref, len);
+        // in place
+        memcpy(out, ints, sizeof(int) * len);
+        parallel_scan(max, out, out, len, INT_MIN, SCAN_INCLUSIVE);
+        errors += check_scan("inclusive max scan", out, ref, len);
+      }
+    }
+  }
+  reduce_grain = PREDUCE_GRAIN;
+  errors += test_repro();
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  else
+    printf("no errors occured.\n");
+  return errors > 0;
+}
+
+/*
+Time per call of the sequential kernel, of the always parallel path (one chunk per thread,
+parallel_reduce_static with grain 1) and of the automatic choice (work stealing with the default
+grain), for growing input lengths. Shows where going parallel starts to pay off. Work stealing
+with grain 1 would time one-element tasks rather than the parallel path.
+*/
+int bench_sweep(void) {
+  int *ints = (int *)malloc(sizeof(int) * BENCH_MAX_LEN);
+  if (ints == NULL)
+    exit(-1);
+  fill(ints, BENCH_MAX_LEN, 100);
+  size_t len, crossover = 0;
+  volatile int sink = 0;
+  printf("%d threads, grain %d\n", pool_threads(), PREDUCE_GRAIN);
+  printf("%10s %14s %14s %14s\n", "length", "seq us/call", "par us/call", "auto us/call");
+  for (len = 16; len <= BENCH_MAX_LEN; len *= 4) {
+    long reps = (len < BENCH_WORK) ? BENCH_WORK / len : 1, r;
+    struct timeval start;
+    double t[3];
+    int mode;
+    for (mode = 0; mode < 3; ++mode) {
+      reduce_grain = (mode == 1) ? 1 : PREDUCE_GRAIN;
+      gettimeofday(&start, NULL);
+      for (r = 0; r < reps; ++r) {
+        if (mode == 0)
+          sink += reduce_sum_int(ints, len, 0);
+        else if (mode == 1)
+          sink += parallel_reduce_static_sum_int(ints, len, 0);
+        else
+          sink += parallel_reduce_sum_int(ints, len, 0);
+      }
+      t[mode] = seconds_since(&start) * 1e6 / reps;
+    }
+    if (crossover == 0 && t[1] < t[0])
+      crossover = len;
+    printf("%10zu %14.3f %14.3f %14.3f\n", len, t[0], t[1], t[2]);
+  }
+  reduce_grain = PREDUCE_GRAIN;
+  if (crossover > 0)
+    printf("parallel is faster from about %zu elements on\n", crossover);
+  else
+    printf("parallel never got faster than sequential\n");
+  free(ints);
+  return 0;
+}
+
+/*
+Sequential against parallel inclusive sum scan for 10^6..SCAN_MAX_LEN ints.
+Lengths whose input, output and reference would not fit into half of the physical memory
+are skipped.
+*/
+int bench_scan(void) {
+  long len;
+  double memory = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  printf("%d threads\n", pool_threads());
+  printf("%12s %12s %12s %10s\n", "length", "seq ms", "par ms", "speedup");
+  for (len = 1000000; len <= SCAN_MAX_LEN; len *= 10) {
+    if (3.0 * sizeof(int) * len > memory / 2) {
+      printf("%12ld skipped, needs %.0f MB\n", len, 3.0 * sizeof(int) * len / (1 << 20));
+      continue;
+    }
+    int *in = (int *)malloc(sizeof(int) * len);
+    int *out = (int *)malloc(sizeof(int) * len);
+    int *ref = (int *)malloc(sizeof(int) * len);
+    if (in == NULL || out == NULL || ref == NULL)
+      exit(-1);
+    // values in [-1, 1], so that no prefix sum overflows
+    fill(in, len, 1);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    typed_scan(sum, in, ref, len, 0, SCAN_INCLUSIVE);
+    double seqTime = seconds_since(&start);
+    gettimeofday(&start, NULL);
+    parallel_scan(sum, in, out, len, 0, SCAN_INCLUSIVE);
+    double parTime = seconds_since(&start);
+    printf("%12ld %12.3f %12.3f %10.2f\n", len, seqTime * 1e3, parTime * 1e3, seqTime / parTime);
+    int errors = check_scan("parallel scan", out, ref, len);
+    free(in); free(out); free(ref);
+    if (errors > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+Static chunks against work stealing when one thread is slower than the others,
+as a core shared with another process would be: thread 0 reduces every range SLOW_FACTOR times.
+With static chunks the whole job waits for the slow chunk; with stealing the others take over.
+*/
+struct SlowJob {
+  const int *data;
+  size_t len;
+  int chunks;
+  struct { _Alignas(CACHE_LINE) int value; } results[MAX_THREADS];
+};
+
+static int slow_sum(const int *data, size_t len) {
+  int reps = (pool_self() == 0) ? SLOW_FACTOR : 1, r;
+  volatile int result = 0;
+  for (r = 0; r < reps; ++r)
+    result = reduce_sum_int(data, len, 0);
+  return result;
+}
+
+static void slow_chunk(void *arg, int i) {
+  struct SlowJob *job = (struct SlowJob *)arg;
+  size_t begin = chunk_begin(job->len, job->chunks, i);
+  size_t end = chunk_begin(job->len, job->chunks, i + 1);
+  job->results[i].value = slow_sum(job->data + begin, end - begin);
+}
+
+static void slow_range(void *arg, size_t begin, size_t end, int self) {
+  struct SlowJob *job = (struct SlowJob *)arg;
+  job->results[self].value += slow_sum(job->data + begin, end - begin);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int bench_imbalance(void) {
+  int *ints = (int *)malloc(sizeof(int) * TEST_LEN);
+  if (ints == NULL)
+    exit(-1);
+  fill(ints, TEST_LEN, 100);
+  int reference = reduce_sum_int(ints, TEST_LEN, 0), errors = 0, mode, run, i;
+  double times[IMBALANCE_RUNS];
+  struct SlowJob job;
+  job.data = ints;
+  job.len = TEST_LEN;
+  printf("%d threads, thread 0 is %d times slower\n", pool_threads(), SLOW_FACTOR);
+  printf("%16s %12s %12s\n", "schedule", "median ms", "worst ms");
+  for (mode = 0; mode < 2; ++mode) {
+    for (run = 0; run < IMBALANCE_RUNS; ++run) {
+      struct timeval start;
+      int result = 0;
+      for (i = 0; i < MAX_THREADS; ++i)
+        job.results[i].value = 0;
+      gettimeofday(&start, NULL);
+      if (mode == 0) {
+        job.chunks = pool_threads();
+        run_chunks(slow_chunk, &job, job.chunks);
+      } else {
+        ws_parallel_for(TEST_LEN, PREDUCE_GRAIN, slow_range, &job);
+      }
+      times[run] = seconds_since(&start) * 1e3;
+      for (i = 0; i < MAX_THREADS; ++i)
+        result += job.results[i].value;
+      errors += (result != reference);
     }
+    qsort(times, IMBALANCE_RUNS, sizeof(double), compare_doubles);
+    printf("%16s %12.3f %12.3f\n", (mode == 0) ? "static" : "work stealing",
+           times[IMBALANCE_RUNS / 2], times[IMBALANCE_RUNS - 1]);
+  }
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  free(ints);
+  pool_shutdown();
+  return errors > 0;
+}
 
-    // wait on termination of all threads
-    for (i = 0; i < NUM_THREADS; ++i)
-        pthread_join(threads[i], NULL);
+/*
+Memory bandwidth of the sum kernel for 1, 2, 4, ... active threads, once on an array first
+touched by the main thread (all pages on its node) and once on one placed with first_touch.
+Run with POOL_PIN=1 on a multi-socket machine: the first array stops scaling once the threads
+reach the second socket, the placed one keeps scaling with the memory controllers of both.
+*/
+struct BandwidthJob {
+  const int *data;
+  size_t len;
+  int active;
+  struct { _Alignas(CACHE_LINE) int value; } results[MAX_THREADS];
+};
 
-    // concatenate results
-    int result = threadData[0].result;
-    for (i = 1; i < NUM_THREADS; ++i)
-        result = op(result, threadData[i].result);
-    
-    return result;
+static void bandwidth_chunk(void *arg, int self) {
+  struct BandwidthJob *job = (struct BandwidthJob *)arg;
+  job->results[self].value = 0;
+  if (self >= job->active)
+    return;
+  size_t begin = chunk_begin(job->len, job->active, self);
+  size_t end = chunk_begin(job->len, job->active, self + 1);
+  job->results[self].value = reduce_sum_int(job->data + begin, end - begin, 0);
 }
 
-int main() {
+int bench_bandwidth(void) {
+  int *central = (int *)malloc(sizeof(int) * BANDWIDTH_LEN);
+  int *placed = (int *)malloc(sizeof(int) * BANDWIDTH_LEN);
+  if (central == NULL || placed == NULL)
+    exit(-1);
+  int threads = pool_threads(), errors = 0, active, i;
+  fill(central, BANDWIDTH_LEN, 100);
+  first_touch(placed, BANDWIDTH_LEN, sizeof(int));
+  memcpy(placed, central, sizeof(int) * BANDWIDTH_LEN);
+  int reference = reduce_sum_int(central, BANDWIDTH_LEN, 0);
+  printf("%d threads, %s\n", threads, pool_pinned() ? "pinned" : "not pinned (set POOL_PIN=1)");
+  printf("%8s %16s %16s\n", "threads", "main GB/s", "placed GB/s");
+  for (active = 1; ; active = (2 * active < threads) ? 2 * active : threads) {
+    double gbs[2];
+    int mode;
+    for (mode = 0; mode < 2; ++mode) {
+      struct BandwidthJob job;
+      double best = 1e30;
+      int run;
+      job.data = (mode == 0) ? central : placed;
+      job.len = BANDWIDTH_LEN;
+      job.active = active;
+      for (run = 0; run < BANDWIDTH_RUNS; ++run) {
+        struct timeval start;
+        int result = 0;
+        gettimeofday(&start, NULL);
+        run_on_threads(bandwidth_chunk, &job);
+        double t = seconds_since(&start);
+        best = (t < best) ? t : best;
+        for (i = 0; i < threads; ++i)
+          result += job.results[i].value;
+        errors += (result != reference);
+      }
+      gbs[mode] = sizeof(int) * (double)BANDWIDTH_LEN / best / 1e9;
+    }
+    printf("%8d %16.2f %16.2f\n", active, gbs[0], gbs[1]);
+    if (active == threads)
+      break;
+  }
+  errors += check("placed reduce", parallel_reduce_placed_sum_int(placed, BANDWIDTH_LEN, 0), reference, 0);
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  free(central); free(placed);
+  pool_shutdown();
+  return errors > 0;
+}
+
+int main(int argc, char **argv) {
+  /*
+  "preduce test": every length 0..TEST_MAX_LEN, "preduce bench": sequential/parallel crossover,
+  "preduce imbalance": static chunks against work stealing with one slow thread,
+  "preduce scan": sequential/parallel prefix sum,
+  "preduce bandwidth": memory bandwidth scaling with central and first-touch placed data
+  */
+  if (argc > 1 && strcmp(argv[1], "test") == 0)
+    return test_lengths();
+  if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    return bench_sweep();
+  if (argc > 1 && strcmp(argv[1], "imbalance") == 0)
+    return bench_imbalance();
+  if (argc > 1 && strcmp(argv[1], "scan") == 0)
+    return bench_scan();
+  if (argc > 1 && strcmp(argv[1], "bandwidth") == 0)
+    return bench_bandwidth();
+
   int data[] = {1,2,3,4,5,6,7,8,9,10};
   int arr_len = *(&data + 1) - data;
 
@@ -82,10 +1036,106 @@ int main() {
 
   printf("max : %i; sum: %i\n", m, s);
 
-  int pm = parallel_reduce(max, data, arr_len);
-  int ps = parallel_reduce(sum, data, arr_len);
+  int pm = parallel_reduce(max, data, arr_len, INT_MIN);
+  int ps = parallel_reduce(sum, data, arr_len, 0);
 
   printf("parallel max : %i; parallel sum: %i\n", pm, ps);
+
+  struct ReduceStats_int stats = parallel_reduce_stats(data, arr_len);
+  printf("fused sum: %i; min: %i; max: %i; count: %zu; sum of squares: %.0f\n",
+         stats.sum, stats.min, stats.max, stats.count, stats.sumSquares);
+
+  /*
+  Check all types on a large random array against the reference reduce().
+  Values stay small, so that int sums do not overflow and float sums are exact enough.
+  */
+  int *ints = (int *)malloc(sizeof(int) * TEST_LEN);
+  int64_t *longs = (int64_t *)malloc(sizeof(int64_t) * TEST_LEN);
+  float *floats = (float *)malloc(sizeof(float) * TEST_LEN);
+  double *doubles = (double *)malloc(sizeof(double) * TEST_LEN);
+  if (ints == NULL || longs == NULL || floats == NULL || doubles == NULL)
+    exit(-1);
+  srand(42);
+  fill(ints, TEST_LEN, 100);
+  int i;
+  for (i = 0; i < TEST_LEN; ++i) {
+    longs[i] = ints[i];
+    floats[i] = ints[i];
+    doubles[i] = ints[i];
+  }
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  int refSum = reduce(sum, ints, TEST_LEN);
+  double refTime = seconds_since(&start);
+  int refMax = reduce(max, ints, TEST_LEN);
+
+  gettimeofday(&start, NULL);
+  int seqSum = typed_reduce(sum, ints, TEST_LEN, 0);
+  double seqTime = seconds_since(&start);
+
+  gettimeofday(&start, NULL);
+  int parSum = parallel_reduce(sum, ints, TEST_LEN, 0);
+  double parTime = seconds_since(&start);
+
+  int errors = 0;
+  errors += check("sum int", parSum, refSum, 0);
+  errors += check("sum int (sequential)", seqSum, refSum, 0);
+  errors += check("max int", parallel_reduce(max, ints, TEST_LEN, INT_MIN), refMax, 0);
+  errors += check("min int", parallel_reduce(min, ints, TEST_LEN, INT_MAX), -refMax, 0);
+  errors += check("sum int64", parallel_reduce(sum, longs, TEST_LEN, 0), refSum, 0);
+  errors += check("max int64", parallel_reduce(max, longs, TEST_LEN, INT64_MIN), refMax, 0);
+  errors += check("sum float", parallel_reduce(sum, floats, TEST_LEN, 0.0f), refSum, 1e-4);
+  errors += check("max float", parallel_reduce(max, floats, TEST_LEN, reduce_identity(max, floats)), refMax, 0);
+  errors += check("sum double", parallel_reduce(sum, doubles, TEST_LEN, 0.0), refSum, 0);
+  errors += check("min double", parallel_reduce(min, doubles, TEST_LEN, reduce_identity(min, doubles)), -refMax, 0);
+  // products of a short run of small values, so that nothing overflows
+  int small[] = {1,2,3,-1,2,1,3,2};
+  double smallD[] = {1,2,3,-1,2,1,3,2};
+  errors += check("prod int", parallel_reduce(prod, small, 8, 1), -72, 0);
+  errors += check("prod double", parallel_reduce(prod, smallD, 8, 1.0), -72, 0);
+  if (errors > 0)
+    printf("%d errors occured.\n", errors);
+  else
+    printf("no errors occured.\n");
+
+  printf("sum of %d ints: reference %f s, typed %f s, typed parallel %f s\n",
+         TEST_LEN, refTime, seqTime, parTime);
+
+  // three separate passes against one fused pass
+  gettimeofday(&start, NULL);
+  int sepSum = parallel_reduce(sum, ints, TEST_LEN, 0);
+  int sepMin = parallel_reduce(min, ints, TEST_LEN, INT_MAX);
+  int sepMax = parallel_reduce(max, ints, TEST_LEN, INT_MIN);
+  double sepTime = seconds_since(&start);
+  gettimeofday(&start, NULL);
+  stats = parallel_reduce_stats(ints, TEST_LEN);
+  double fusedTime = seconds_since(&start);
+  errors = check("fused sum", stats.sum, sepSum, 0) + check("fused min", stats.min, sepMin, 0)
+         + check("fused max", stats.max, sepMax, 0) + check("fused count", stats.count, TEST_LEN, 0)
+         + check("fused sum of squares", stats.sumSquares, typed_reduce_stats(ints, TEST_LEN).sumSquares, 1e-12);
+  printf("sum, min and max of %d ints: separate %f s, fused %f s%s\n",
+         TEST_LEN, sepTime, fusedTime, (errors > 0) ? " (wrong)" : "");
+
+  // fast against reproducible double sum; the printed bits must not change with POOL_THREADS
+  for (i = 0; i < TEST_LEN; ++i)
+    doubles[i] = ints[i] * 0.1;
+  gettimeofday(&start, NULL);
+  double fastSum = parallel_reduce(sum, doubles, TEST_LEN, 0.0);
+  double fastTime = seconds_since(&start);
+  gettimeofday(&start, NULL);
+  double reproSum = parallel_reduce_repro(sum, doubles, TEST_LEN, 0.0);
+  double reproTime = seconds_since(&start);
+  printf("sum of %d doubles: fast %f s (%a), reproducible %f s (%a)\n",
+         TEST_LEN, fastTime, fastSum, reproTime, reproSum);
+
+  // cost of handing a job to the pool and waiting for it, without any work
+  gettimeofday(&start, NULL);
+  for (i = 0; i < DISPATCH_CALLS; ++i)
+    run_chunks(empty_task, NULL, pool_threads());
+  printf("%d threads: %f us per dispatch\n", pool_threads(), seconds_since(&start) * 1e6 / DISPATCH_CALLS);
+
+  free(ints); free(longs); free(floats); free(doubles);
+  pool_shutdown();
   return 0;
 }
-
@@ -0,0 +1,497 @@
+#ifndef WSCHED_H
+#define WSCHED_H
+
+/*
+Thread pool with static and work-stealing scheduling, header only.
+Include it from exactly one translation unit of a program (C11 or C++11) and link with -lpthread.
+
+  run_chunks(fn, arg, n)                 fn(arg, i) for i = 0..n-1, one task per call
+  run_on_threads(fn, arg)                fn(arg, self) once on every thread of the pool
+  ws_parallel_for(n, grain, body, arg)   body(arg, begin, end, self) over [0, n), load balanced
+
+Worker threads are created on first use: one less than the number of cpus (or POOL_THREADS
+from the environment), since the calling thread always works on its own job as well.
+With POOL_PIN=1 in the environment (Linux, compiled with _GNU_SOURCE) every thread of the pool,
+the calling one included, is pinned to its own cpu. Memory first touched inside run_on_threads
+then stays on the node of the thread that will work on it again in the next run_on_threads.
+Only one job runs at a time; jobs must not be started from inside a job.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define POOL_CAN_PIN
+#endif
+
+#ifdef __cplusplus
+// the C11 atomics used below, taken from <atomic>
+#include <atomic>
+typedef std::atomic<int> ws_atomic_int;
+typedef std::atomic<long> ws_atomic_long;
+typedef std::atomic<uint64_t> ws_atomic_u64;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_seq_cst;
+using std::atomic_init;
+using std::atomic_load;
+using std::atomic_store;
+using std::atomic_fetch_add;
+using std::atomic_fetch_sub;
+using std::atomic_load_explicit;
+using std::atomic_store_explicit;
+using std::atomic_fetch_sub_explicit;
+using std::atomic_compare_exchange_weak_explicit;
+using std::atomic_compare_exchange_strong_explicit;
+using std::atomic_thread_fence;
+#define WS_ALIGNAS(n) alignas(n)
+#define WS_THREAD_LOCAL thread_local
+#else
+#include <stdatomic.h>
+typedef atomic_int ws_atomic_int;
+typedef atomic_long ws_atomic_long;
+typedef _Atomic uint64_t ws_atomic_u64;
+#define WS_ALIGNAS(n) _Alignas(n)
+#define WS_THREAD_LOCAL _Thread_local
+#endif
+
+// upper bound for the number of threads of the pool (including the calling thread)
+#define MAX_THREADS (256)
+// polls of an idle worker before it sleeps until the next job, and of a thread waiting
+// inside a job before it yields between polls
+#define POOL_SPIN (1 << 14)
+// entries per work-stealing deque, must be a power of two
+#define WS_DEQUE_SIZE (256)
+// size of a cache line
+#define CACHE_LINE (64)
+// flag in the task half of the ticket: the job is fn(arg, self) on every thread
+#define POOL_EACH (0x80000000u)
+
+// hint the cpu that we are inside a spin loop
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// ######################################################
+// Start deque section
+
+/*
+Chase-Lev work-stealing deque (in the C11 formulation of Le, Pop, Cohen and Zappa Nardelli).
+The owning thread pushes and takes at the bottom, all other threads steal from the top.
+Entries are index ranges packed into one word (begin << 32 | end), so that an entry can be
+read and written atomically. The deque has a fixed size; a full deque makes push fail and
+the caller simply keeps the work for itself.
+*/
+struct WsDeque {
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_long top;
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_long bottom;
+    ws_atomic_u64 entries[WS_DEQUE_SIZE];
+};
+
+static inline uint64_t ws_pack(uint64_t begin, uint64_t end) {
+    return (begin << 32) | end;
+}
+
+// owner only
+static int ws_push(struct WsDeque *q, uint64_t range) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    if (b - t >= WS_DEQUE_SIZE)
+        return 0;
+    atomic_store_explicit(&q->entries[b & (WS_DEQUE_SIZE - 1)], range, memory_order_relaxed);
+    // publishes the entry (and the job it belongs to) to thieves
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+    return 1;
+}
+
+// owner only: newest entry first
+static int ws_take(struct WsDeque *q, uint64_t *range) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    int ok = 1;
+    if (t <= b) {
+        *range = atomic_load_explicit(&q->entries[b & (WS_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b) {
+            // last entry: race against thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed))
+                ok = 0;
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        ok = 0;
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return ok;
+}
+
+// any thread: oldest (and therefore largest) entry first
+static int ws_steal(struct WsDeque *q, uint64_t *range) {
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (t >= b)
+        return 0;
+    *range = atomic_load_explicit(&q->entries[t & (WS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed);
+}
+
+// end deque section
+// ######################################################
+
+// ######################################################
+// Start pool section
+
+/*
+Persistent thread pool: worker threads are created once (on first use) and then wait for jobs.
+Every job gets a new epoch in the upper half of ticket. Idle workers poll the epoch for
+POOL_SPIN rounds, so back-to-back jobs start without any syscall, and then sleep on a
+condition variable. The caller only takes the lock to wake them if somebody sleeps.
+
+Static jobs (run_chunks) keep their unclaimed tasks in the lower half of ticket. A thread
+claims a task by decrementing it with a CAS that also checks the epoch, so a worker that is
+late for one job can never take a task of the next one. Per-thread jobs (run_on_threads) set
+POOL_EACH instead, every worker runs the job once and the caller waits for all of them.
+
+Work-stealing jobs (ws_parallel_for) start as a single range in the caller's deque. A thread
+splits its range in halves, pushes the upper half and goes on with the lower one until the
+range is at most grain long; idle threads steal the oldest, largest ranges of others. A slow
+or preempted thread therefore only holds back the small range it is working on.
+*/
+struct ThreadPool {
+    // threads besides the caller
+    int workers;
+    pthread_t threads[MAX_THREADS];
+    // cpu of every thread if the pool is pinned, else -1
+    int cpus[MAX_THREADS];
+    // static or per-thread job, written by the caller before the ticket is published
+    void (*fn)(void *, int);
+    void *arg;
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_u64 ticket;
+    // static tasks (or workers of a per-thread job) not finished yet
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_int remaining;
+    // work-stealing job
+    WS_ALIGNAS(CACHE_LINE) void (*body)(void *, size_t, size_t, int);
+    void *bodyArg;
+    size_t base;
+    size_t grain;
+    // elements of the work-stealing job not processed yet
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_long wsRemaining;
+    // parking of idle workers
+    WS_ALIGNAS(CACHE_LINE) ws_atomic_int sleeping;
+    ws_atomic_int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // one deque per thread, the caller uses the last one
+    struct WsDeque deques[MAX_THREADS];
+};
+
+/*
+One poll of a thread that waits inside a job (for work to steal or for the other threads to
+finish). After POOL_SPIN polls it yields the cpu between polls: on an oversubscribed or
+shared host the thread it waits for may be preempted, and spinning would only take cpu time
+away from it.
+*/
+static inline void pool_backoff(int *spins) {
+    if (*spins < POOL_SPIN) {
+        ++(*spins);
+        cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+static struct ThreadPool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+// index of the current thread: 0..workers-1 for workers, workers for the calling thread
+static WS_THREAD_LOCAL int poolSelf = -1;
+
+// claim and run static tasks of job epoch until none are left
+static void pool_work(unsigned epoch) {
+    uint64_t t = atomic_load_explicit(&pool.ticket, memory_order_acquire);
+    while ((unsigned)(t >> 32) == epoch && (t & 0xffffffffu) > 0 && !(t & POOL_EACH)) {
+        if (atomic_compare_exchange_weak_explicit(&pool.ticket, &t, t - 1,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            // the job cannot finish before our task, so fn and arg are still valid
+            pool.fn(pool.arg, (int)(t & 0xffffffffu) - 1);
+            atomic_fetch_sub_explicit(&pool.remaining, 1, memory_order_release);
+            t = atomic_load_explicit(&pool.ticket, memory_order_acquire);
+        }
+    }
+}
+
+// run range, splitting off upper halves for thieves until it is at most grain long
+static void ws_run(int self, uint64_t range) {
+    // ws_parallel_for writes the job fields before it pushes the first range (and only then
+    // publishes the job); a stolen range is read after an acquire of the bottom its push released,
+    // so the job fields are valid here whichever deque the range came from
+    size_t begin = (size_t)(range >> 32), end = (size_t)(range & 0xffffffffu);
+    while (end - begin > pool.grain) {
+        size_t mid = begin + (end - begin) / 2;
+        if (!ws_push(&pool.deques[self], ws_pack(mid, end)))
+            break;
+        end = mid;
+    }
+    pool.body(pool.bodyArg, pool.base + begin, pool.base + end, self);
+    // elements pushed to the deque are accounted for by whoever runs them
+    atomic_fetch_sub_explicit(&pool.wsRemaining, (long)(end - begin), memory_order_release);
+}
+
+/*
+Take from the own deque or steal from a random other one until the work-stealing job is done.
+Workers also stop once a newer job has been published (epoch != current), the caller never.
+*/
+static void ws_work(int self, unsigned epoch) {
+    int threads = pool.workers + 1;
+    uint64_t range;
+    unsigned seed = 2654435761u * (unsigned)(self + 1);
+    int spins = 0;
+    while (atomic_load_explicit(&pool.wsRemaining, memory_order_acquire) > 0) {
+        if (self < pool.workers &&
+            (unsigned)(atomic_load_explicit(&pool.ticket, memory_order_relaxed) >> 32) != epoch)
+            break;
+        if (ws_take(&pool.deques[self], &range)) {
+            ws_run(self, range);
+            spins = 0;
+            continue;
+        }
+        // xorshift to pick a victim
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        int victim = (int)(seed % (unsigned)threads);
+        if (victim != self && ws_steal(&pool.deques[victim], &range)) {
+            ws_run(self, range);
+            spins = 0;
+            continue;
+        }
+        pool_backoff(&spins);
+    }
+}
+
+// pins the calling thread to the cpu chosen for thread self, if any
+static void pin_thread(int self) {
+#ifdef POOL_CAN_PIN
+    if (pool.cpus[self] >= 0) {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(pool.cpus[self], &one);
+        pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+    }
+#else
+    (void)self;
+#endif
+}
+
+static void *pool_worker(void *param) {
+    unsigned seen = 0;
+    poolSelf = (int)(intptr_t)param;
+    pin_thread(poolSelf);
+    for (;;) {
+        unsigned epoch;
+        uint64_t t;
+        int spins = 0;
+        // wait for the next job: poll for a while, then sleep
+        while ((epoch = (unsigned)((t = atomic_load_explicit(&pool.ticket, memory_order_acquire)) >> 32)) == seen
+               && !atomic_load(&pool.shutdown)) {
+            if (spins < POOL_SPIN) {
+                ++spins;
+                cpu_relax();
+                continue;
+            }
+            pthread_mutex_lock(&pool.lock);
+            atomic_fetch_add(&pool.sleeping, 1);
+            while ((unsigned)(atomic_load(&pool.ticket) >> 32) == seen && !atomic_load(&pool.shutdown))
+                pthread_cond_wait(&pool.wake, &pool.lock);
+            atomic_fetch_sub(&pool.sleeping, 1);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (atomic_load(&pool.shutdown))
+            break;
+        seen = epoch;
+        if (t & POOL_EACH) {
+            // the caller waits for every worker, so fn and arg stay valid
+            pool.fn(pool.arg, poolSelf);
+            atomic_fetch_sub_explicit(&pool.remaining, 1, memory_order_release);
+            continue;
+        }
+        // otherwise the job is static (tasks in the ticket) or work-stealing (ranges in the deques)
+        pool_work(epoch);
+        ws_work(poolSelf, epoch);
+    }
+    return NULL;
+}
+
+// number of threads from POOL_THREADS or else the number of online cpus
+static int hardware_threads(void) {
+    const char *env = getenv("POOL_THREADS");
+    long n = (env != NULL) ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    return (int)n;
+}
+
+/*
+With POOL_PIN=1 thread i gets the i-th cpu the process may run on (wrapping around if there are
+more threads than cpus). The list is taken before any thread is pinned, as threads inherit it.
+*/
+static void choose_cpus(void) {
+    int i;
+    for (i = 0; i < MAX_THREADS; ++i)
+        pool.cpus[i] = -1;
+#ifdef POOL_CAN_PIN
+    const char *env = getenv("POOL_PIN");
+    cpu_set_t allowed;
+    int list[CPU_SETSIZE], count = 0, cpu;
+    if (env == NULL || atoi(env) == 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &allowed))
+            list[count++] = cpu;
+    for (i = 0; i <= pool.workers && count > 0; ++i)
+        pool.cpus[i] = list[i % count];
+#endif
+}
+
+static void pool_init(void) {
+    int i;
+    pool.workers = hardware_threads() - 1;
+    choose_cpus();
+    atomic_init(&pool.ticket, (uint64_t)0);
+    atomic_init(&pool.remaining, 0);
+    atomic_init(&pool.wsRemaining, 0L);
+    atomic_init(&pool.sleeping, 0);
+    atomic_init(&pool.shutdown, 0);
+    for (i = 0; i < MAX_THREADS; ++i) {
+        atomic_init(&pool.deques[i].top, 0L);
+        atomic_init(&pool.deques[i].bottom, 0L);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    poolSelf = pool.workers;
+    for (i = 0; i < pool.workers; ++i)
+        pthread_create(&pool.threads[i], NULL, pool_worker, (void *)(intptr_t)i);
+    pin_thread(pool.workers);
+}
+
+// number of threads working on a job, including the calling thread
+static inline int pool_threads(void) {
+    pthread_once(&poolOnce, pool_init);
+    return pool.workers + 1;
+}
+
+// 1 if the threads of the pool are pinned to cpus
+static inline int pool_pinned(void) {
+    pthread_once(&poolOnce, pool_init);
+    return pool.cpus[0] >= 0;
+}
+
+// index of the calling thread within the pool, 0..pool_threads()-1
+static inline int pool_self(void) {
+    pthread_once(&poolOnce, pool_init);
+    return (poolSelf >= 0) ? poolSelf : pool.workers;
+}
+
+// start a new job: bump the epoch (with static tasks in the lower half) and wake sleepers
+static unsigned pool_publish(unsigned tasks) {
+    unsigned epoch = (unsigned)(atomic_load_explicit(&pool.ticket, memory_order_relaxed) >> 32) + 1;
+    // the release makes the job fields visible to the workers
+    atomic_store_explicit(&pool.ticket, ((uint64_t)epoch << 32) | tasks, memory_order_seq_cst);
+    // only wake sleeping workers if there are any (pairs with sleeping++ before their re-check)
+    if (atomic_load(&pool.sleeping) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return epoch;
+}
+
+/*
+Runs fn(arg, i) for i = 0..n-1 on the pool and the calling thread
+and returns once all calls have finished.
+*/
+static inline void run_chunks(void (*fn)(void *, int), void *arg, int n) {
+    pthread_once(&poolOnce, pool_init);
+    if (n <= 0)
+        return;
+    pool.fn = fn;
+    pool.arg = arg;
+    atomic_store_explicit(&pool.remaining, n, memory_order_relaxed);
+    unsigned epoch = pool_publish((unsigned)n);
+    // take part in the job, then wait for the tasks taken by the workers
+    pool_work(epoch);
+    int spins = 0;
+    while (atomic_load_explicit(&pool.remaining, memory_order_acquire) > 0)
+        pool_backoff(&spins);
+}
+
+/*
+Runs fn(arg, self) once on every thread of the pool (self = 0..pool_threads()-1)
+and returns once all calls have finished.
+*/
+static inline void run_on_threads(void (*fn)(void *, int), void *arg) {
+    pthread_once(&poolOnce, pool_init);
+    pool.fn = fn;
+    pool.arg = arg;
+    atomic_store_explicit(&pool.remaining, pool.workers, memory_order_relaxed);
+    pool_publish(POOL_EACH);
+    fn(arg, pool.workers);
+    int spins = 0;
+    while (atomic_load_explicit(&pool.remaining, memory_order_acquire) > 0)
+        pool_backoff(&spins);
+}
+
+/*
+Runs body(arg, begin, end, self) over disjoint ranges covering [0, n), each at most grain
+long (but not split below grain), load balanced by work stealing. self is the index of the
+executing thread (0..pool_threads()-1) and can be used to address per-thread state.
+Returns once all ranges have been processed.
+*/
+static inline void ws_parallel_for(size_t n, size_t grain, void (*body)(void *, size_t, size_t, int), void *arg) {
+    pthread_once(&poolOnce, pool_init);
+    int self = pool.workers;
+    pool.body = body;
+    pool.bodyArg = arg;
+    pool.grain = (grain > 0) ? grain : 1;
+    // ranges are packed into 32 bit halves: very long inputs run as several jobs
+    for (pool.base = 0; pool.base < n; pool.base += 0x80000000u) {
+        size_t len = n - pool.base;
+        if (len > 0x80000000u)
+            len = 0x80000000u;
+        atomic_store_explicit(&pool.wsRemaining, (long)len, memory_order_relaxed);
+        ws_push(&pool.deques[self], ws_pack(0, len));
+        unsigned epoch = pool_publish(0);
+        ws_work(self, epoch);
+    }
+}
+
+// stops and joins all workers
+static inline void pool_shutdown(void) {
+    int i;
+    if (pool.workers <= 0)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    atomic_store(&pool.shutdown, 1);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.workers; ++i)
+        pthread_join(pool.threads[i], NULL);
+    pool.workers = 0;
+}
+
+// end pool section
+// ######################################################
+
+#endif